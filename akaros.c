@@ -94,13 +94,55 @@ void set_sched_realtime(void)
 {
 }
 
-struct sample *allocate_samples(size_t samples_size)
+int allocate_samples(struct sample_region *r, size_t samples_size)
 {
 	struct sample *samples;
 
+	memset(r, 0, sizeof(*r));
+	r->node = -1;
+	r->pagesize = sysconf(_SC_PAGESIZE);
+	r->kind = "base";
 	samples = mmap(0, samples_size, PROT_READ | PROT_WRITE,
 	               MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE | MAP_LOCKED,
 	               -1, 0);
 	assert(samples != MAP_FAILED);
-	return samples;
+	r->samples = samples;
+	r->size = samples_size;
+	return 0;
+}
+
+int map_samples_file(struct sample_region *r, const char *name, size_t size)
+{
+	fprintf(stderr, "-m: not supported on this OS\n");
+	return -1;
+}
+
+int pmu_open(struct pmu *pmu, const char *events)
+{
+	fprintf(stderr, "pmu: not supported on this OS\n");
+	return -1;
+}
+
+void pmu_close(struct pmu *pmu)
+{
+}
+
+int irq_snapshot(struct irqsnap *snap)
+{
+	return -1;
+}
+
+size_t cache_size(int level)
+{
+	return 0;
+}
+
+int cpu_list(const char *list, int *cpus, int max)
+{
+	return -1;
+}
+
+int cpu_isolation(int cpu)
+{
+	return 0;
 }
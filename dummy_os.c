@@ -46,7 +46,41 @@ void set_sched_realtime(void)
 {
 }
 
-struct sample *allocate_samples(size_t samples_size)
+int cpu_list(const char *list, int *cpus, int max)
 {
-	return NULL;
+	return -1;
+}
+
+int cpu_isolation(int cpu)
+{
+	return 0;
+}
+
+int allocate_samples(struct sample_region *r, size_t samples_size)
+{
+	return -1;
+}
+
+int map_samples_file(struct sample_region *r, const char *name, size_t size)
+{
+	return -1;
+}
+
+int pmu_open(struct pmu *pmu, const char *events)
+{
+	return -1;
+}
+
+void pmu_close(struct pmu *pmu)
+{
+}
+
+int irq_snapshot(struct irqsnap *snap)
+{
+	return -1;
+}
+
+size_t cache_size(int level)
+{
+	return 0;
 }
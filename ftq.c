@@ -23,7 +23,22 @@
  * for details.
  */
 #include "ftq.h"
+#include "ftqbin.h"
+#include "ftqring.h"
+#include "ftqevent.h"
+#include "ftqtrig.h"
+#include "ftqtel.h"
+#include "ftqhist.h"
+#include "welch.h"
+#include "pmu.h"
+#include "irqtrace.h"
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -33,10 +48,59 @@ int ignore_wire_failures = 0;
 
 static int set_realtime = 0;
 static int pin_threads = 1;
+/* -c: thread i goes on cpus[i]; else on the i-th cpu we may use */
+static char *cpu_arg;
+static int *cpus;
+static int ncpus;
 static int rt_free_cores = 2;
-static volatile int hounds = 0;
-/* samples: each sample has a timestamp and a work count. */
-static struct sample *samples;
+/*
+ * Per measuring thread; each is written only by its own thread until
+ * the join. samples: each sample has a timestamp and a work count. Each
+ * thread has its own region, allocated and first touched on its core.
+ */
+struct threadinfo {
+	struct sample_region region;
+	/* when we saw the start deadline, minus the deadline */
+	long long skew;
+	unsigned long long total_count;
+	/* where it is wired, or -1, and cpu_isolation() of that */
+	int core;
+	int isolation;
+	/* for FWQ, the least ticks a sample took */
+	unsigned long long max_count;
+	/* hardware counters, and their per-sample deltas */
+	struct pmu pmu;
+	struct sample_region pmcregion;
+	/* how each sample ended, and the sum of it; see struct overrun */
+	struct sample_region ovrregion;
+	unsigned long long caught;
+	ticks overrun, longest;
+	size_t longest_at;
+	/* memory kernels' buffer */
+	struct sample_region kregion;
+	struct membuf membuf;
+	/* event mode: the dips only, in region */
+	struct event_log events;
+	/* trigger mode: segments, ring and summaries, all in region */
+	struct trig trig;
+	/* every sample's count and length, as it ran */
+	struct thread_hist hist;
+	/* -m: the whole mapped file, and its header at the front of it */
+	struct sample_region mapregion;
+	struct ftqbin_header *maphdr;
+};
+static struct threadinfo *tinfo;
+/*
+ * the common start: threads check in, the last one sets the deadline.
+ * With -F, this and tinfo are in memory shared with the children.
+ */
+struct start {
+	int ready;
+	int hounds;
+	ticks epoch;
+};
+static struct start start_local, *start = &start_local;
+static ticks epoch;
 static size_t numsamples = DEFAULT_COUNT;
 static double ticksperns;
 static unsigned long long interval = DEFAULT_INTERVAL;
@@ -44,12 +108,80 @@ static unsigned long delay_msec;
 static int numthreads = 1;
 static unsigned long long total_count;
 static unsigned long long max_work;
+/* all the threads' histograms, merged when they are done */
+static struct thread_hist all_hist;
+static int use_binary = 0;
+/* pack the samples in binary files and archives; see ftqpack.h */
+static int use_pack;
+/*
+ * -m: the samples go straight into the binary files, mapped shared, so
+ * that a run that is killed leaves what it had; see map_output(). Until
+ * the totals are in, the files' text says it is unfinished.
+ */
+static int use_map;
+static int unfinished;
+static int use_psd = 0;
+static int use_stdout = 0;
+static char outname[255];
+static char *pmu_events;
+/* the end of the measurement, before each thread writes its files */
+static pthread_barrier_t done_barrier;
+/* streaming mode: rings drained to the files by a housekeeping thread */
+static int use_stream = 0;
+static int housekeeping_core = -1;
+static size_t ringsize = DEFAULT_RING;
+static struct ring *rings;
+static FILE **streamfiles;
+static volatile int stop;
+static volatile int drain_done;
+/* the work done in each sample; see ftqcore.c */
+static const struct kernel *kernel = &kernels[0];
+/* write the overrun columns in text files too */
+static int show_overrun;
+/* FWQ mode: units of kernel work per sample; 0 for FTQ */
+static unsigned long long fwq_units;
+/* timer by name, or NULL to pick one */
+static char *timer_name;
+/* event mode: keep dips below this percent of the peak; 0 for off */
+static unsigned int event_pct;
+static unsigned int event_context;
+/* trigger mode: on a low count, in percent of the peak, or a late start */
+static int use_trigger;
+static unsigned int trig_pct;
+static unsigned long long trig_late_ns;
+static size_t trig_pre = DEFAULT_PRETRIGGER, trig_post = DEFAULT_POSTTRIGGER;
+static unsigned long long trig_decimate = DEFAULT_DECIMATE;
+/* interrupt timeline sampling period; 0 for none */
+static unsigned long irq_msec;
+/* live telemetry for ftqtop, in a file mapped shared; see ftqtel.h */
+static char *tel_path;
+static struct tel_header *tel;
+/*
+ * -A: a sweep over the -f, -t, -k and -c lists, into one archive. The
+ * kernel buffer is allocated once, big enough for any of the kernels.
+ */
+static char *archive_name;
+static char *freq_arg, *thread_arg, *kernel_arg;
+static size_t kbuf_size;
+/* a process per thread, and where each leaves its results */
+static int use_procs;
+static char **results;
 
 void usage(char *av0)
 {
 	fprintf(stderr,
 			"usage: %s [-t threads] [-n samples] [-f frequency] [-h] [-o outname] [-s] [-r] [-d delay_msec] "
-			"[-T ticks-per-ns-float] "
+			"[-T ticks-per-ns-float] [-b (binary output)] "
+			"[-P (PSD output, as pwelch: mean out, hamming, 8 segments)] "
+			"[-S (stream)] [-H housekeeping-core] [-R ring-samples] "
+			"[-p pmu-event,...] [-i irq-period-msec] "
+			"[-e event-percent] [-C event-context] [-k kernel|list] "
+			"[-x timer|auto|list] [-W fwq-work-units] "
+			"[-g trigger-percent] [-G trigger-late-ns] [-B pre,post] "
+			"[-D decimate] [-O (overrun columns)] [-M telemetry-file] "
+			"[-F (a process per thread)] [-c cpu-list] "
+			"[-A sweep-archive] [-z (pack -b and -A samples)] "
+			"[-m (samples in mapped -b files on tmpfs, kept if killed)] "
 			"[-w (ignore wire failures -- only do this if there is no option]"
 			"\n",
 			av0);
@@ -57,6 +189,136 @@ void usage(char *av0)
 	exit(EXIT_FAILURE);
 }
 
+static void kernel_usage(void)
+{
+	const struct kernel *k;
+
+	fprintf(stderr, "kernels:\n");
+	for (k = kernels; k->name; k++)
+		fprintf(stderr, "  %-8s %s%s\n", k->name, k->desc,
+		        k->supported && !k->supported() ? " (not on this cpu)" : "");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Measure every timer, for the header, then take the one asked for:
+ * ticks, unless -x says otherwise, and with -x auto the cheapest one
+ * that keeps the work between its reads and is not erratic. The other
+ * loops (-S, -p, -e, -g) only come with the default timer.
+ */
+static void pick_timer(int fixed)
+{
+	struct timer *t, *best = NULL;
+	int i;
+
+	for (i = 0; i < NTIMERS; i++)
+		timer_measure(&timers[i], ticksperns);
+	if (timer_name && !strcmp(timer_name, "list")) {
+		fprintf(stderr, "timers:\n");
+		for (i = 0; i < NTIMERS; i++)
+			fprintf(stderr, "  %-8s %8.2f ns per read, %8.2f ns p99  %s\n",
+			        timers[i].name, timers[i].cost, timers[i].jitter,
+			        timers[i].desc);
+		exit(EXIT_FAILURE);
+	}
+	if (timer_name && strcmp(timer_name, "auto")) {
+		for (i = 0; i < NTIMERS; i++)
+			if (!strcmp(timers[i].name, timer_name))
+				best = &timers[i];
+		if (!best) {
+			fprintf(stderr, "ERROR: no timer %s; -x list shows them.\n",
+			        timer_name);
+			exit(EXIT_FAILURE);
+		}
+		if (fixed && best != &timers[0]) {
+			fprintf(stderr, "ERROR: -S, -p, -e and -g use the %s timer "
+			        "only.\n", timers[0].name);
+			exit(EXIT_FAILURE);
+		}
+	} else if (timer_name && !fixed) {
+		/* -x auto */
+		for (i = 0; i < NTIMERS; i++) {
+			t = &timers[i];
+			if (!t->ordered || t->jitter > 4 * t->cost)
+				continue;
+			if (!best || t->cost < best->cost)
+				best = t;
+		}
+	}
+	timer = best ? best : &timers[0];
+	if (timer->ns)
+		ticksperns = 1.0;
+}
+
+/* only the kernel loops say how each sample ended */
+static int has_overrun(void)
+{
+	return !use_stream && !event_pct && !use_trigger && !pmu_events
+	       && !fwq_units;
+}
+
+/*
+ * A sample that starts after its quantum is over only catches up; its
+ * overrun belongs to the one that made it late, so count it, not its over.
+ */
+static void sum_overrun(int thread)
+{
+	struct threadinfo *ti = &tinfo[thread];
+	struct overrun *ovr = (struct overrun *)ti->ovrregion.samples;
+	struct sample *s = ti->region.samples;
+	size_t i;
+
+	for (i = 0; i < numsamples; i++) {
+		if (s[i].ticklast >= ovr[i].end - ovr[i].over) {
+			ti->caught++;
+			continue;
+		}
+		ti->overrun += ovr[i].over;
+		if (ovr[i].over > ti->longest) {
+			ti->longest = ovr[i].over;
+			ti->longest_at = i;
+		}
+	}
+}
+
+/*
+ * Percentiles of a thread's histograms. Low counts are the noise, so
+ * for them it is the bottom tail, except for FWQ, where counts are ticks.
+ */
+static void write_hist(FILE *f, const char *who, const struct thread_hist *h)
+{
+	static const double tail[] = { 99, 99.9, 99.99 };
+	const struct hist *c = &h->count, *l = &h->length;
+	double pct;
+	int i;
+
+	if (!c->n)
+		return;
+	fprintf(f, "# %scount p50 %llu", who,
+	        (unsigned long long)hist_value(c, 50));
+	for (i = 0; i < 3; i++) {
+		pct = fwq_units ? tail[i] : 100 - tail[i];
+		fprintf(f, " p%g %llu", pct, (unsigned long long)hist_value(c, pct));
+	}
+	fprintf(f, " min %llu max %llu\n", (unsigned long long)c->min,
+	        (unsigned long long)c->max);
+	fprintf(f, "# %slength ns p50 %.0f", who, hist_value(l, 50) / ticksperns);
+	for (i = 0; i < 3; i++)
+		fprintf(f, " p%g %.0f", tail[i], hist_value(l, tail[i]) / ticksperns);
+	fprintf(f, " max %.0f\n", l->max / ticksperns);
+}
+
+static void merge_hists(void)
+{
+	int i;
+
+	memset(&all_hist, 0, sizeof(all_hist));
+	for (i = 0; i < numthreads; i++) {
+		hist_merge(&all_hist.count, &tinfo[i].hist.count);
+		hist_merge(&all_hist.length, &tinfo[i].hist.length);
+	}
+}
+
 void header(FILE * f, int thread)
 {
 	fprintf(f, "# Frequency %f\n", 1e9 / interval);
@@ -64,39 +326,858 @@ void header(FILE * f, int thread)
 	fprintf(f, "# octave: pkg load signal\n");
 	fprintf(f, "# x = load(<file name>)\n");
 	fprintf(f, "# pwelch(x(:,2),[],[],[],%f)\n", 1e9 / interval);
-	fprintf(f, "# thread %d, core %d\n", thread, get_coreid());
+	fprintf(f, "# thread %d, core %d\n", thread, tinfo[thread].core);
+	if (tinfo[thread].core >= 0)
+		fprintf(f, "# core isolation:%s%s%s\n",
+		        tinfo[thread].isolation & CORE_ISOLCPUS ? " isolcpus" : "",
+		        tinfo[thread].isolation & CORE_NOHZ_FULL ? " nohz_full" : "",
+		        tinfo[thread].isolation ? "" : " none");
+	if (use_procs)
+		fprintf(f, "# one process per thread\n");
+	fprintf(f, "# samples on node %d, %zuK %s pages\n", tinfo[thread].region.node,
+	        tinfo[thread].region.pagesize >> 10, tinfo[thread].region.kind);
+	fprintf(f, "# kernel %s: %s\n", kernel->name, kernel->desc);
+	fprintf(f, "# timer %s: %s, %g ns per read, %g ns p99 between reads\n",
+	        timer->name, timer->desc, timer->cost, timer->jitter);
+	if (kernel->level)
+		fprintf(f, "# kernel buffer %zuK, on %zuK %s pages\n",
+		        tinfo[thread].membuf.size >> 10,
+		        tinfo[thread].kregion.pagesize >> 10,
+		        tinfo[thread].kregion.kind);
 	fprintf(f, "# start delay %lu msec\n", delay_msec);
-	fprintf(f, "# Total count is %llu\n", total_count);
-	fprintf(f, "# Max possible work is %llu\n", max_work);
-	fprintf(f, "# Fraction is %g\n", (1.0 * total_count) / max_work);
+	if (!unfinished)
+		fprintf(f, "# start skew %lld ticks (%g ns)\n", tinfo[thread].skew,
+		        tinfo[thread].skew / ticksperns);
+	if (fwq_units)
+		fprintf(f, "# fwq: %llu units of work per sample, count is ticks "
+		        "taken\n", fwq_units);
+	/* streaming files get these at the end, once they are known */
+	if (unfinished) {
+		fprintf(f, "# unfinished: no totals; the samples are the ones "
+		        "stored before it stopped\n");
+	} else if (fwq_units) {
+		fprintf(f, "# Total ticks is %llu\n", total_count);
+		fprintf(f, "# Min possible ticks is %llu\n", max_work);
+		fprintf(f, "# Fraction is %g\n", (1.0 * max_work) / total_count);
+	} else if (!use_stream) {
+		fprintf(f, "# Total count is %llu\n", total_count);
+		fprintf(f, "# Max possible work is %llu\n", max_work);
+		fprintf(f, "# Fraction is %g\n", (1.0 * total_count) / max_work);
+	} else {
+		fprintf(f, "# streaming, %zu sample ring\n", ringsize);
+	}
+	if (!use_stream) {
+		write_hist(f, "", &tinfo[thread].hist);
+		if (numthreads > 1)
+			write_hist(f, "all threads: ", &all_hist);
+	}
+	if (has_overrun()) {
+		struct threadinfo *ti = &tinfo[thread];
+
+		if (!unfinished)
+			fprintf(f, "# overrun: %g ns past the quantum ends in all, "
+			        "longest %g ns at sample %zu, %llu samples catching up\n",
+			        ti->overrun / ticksperns, ti->longest / ticksperns,
+			        ti->longest_at, ti->caught);
+		if (show_overrun)
+			fprintf(f, "# columns: time count end over\n");
+	}
+	if (use_trigger) {
+		struct trig *t = &tinfo[thread].trig;
+
+		fprintf(f, "# trigger:");
+		if (trig_pct)
+			fprintf(f, " below %u%% of the running peak", trig_pct);
+		if (trig_late_ns)
+			fprintf(f, "%s starting %llu ns late", trig_pct ? ", or" : "",
+			        trig_late_ns);
+		fprintf(f, "\n");
+		fprintf(f, "# %zu before, %zu after; summaries of %llu samples\n",
+		        t->pre, t->post, t->decimate);
+		fprintf(f, "# %llu samples, peak %llu, %zu segments, %llu dropped, "
+		        "%zu summaries, %llu samples unsummarized\n", t->samples,
+		        t->peak, t->nsegs, t->dropped_segs, t->nsums,
+		        t->dropped_sums);
+	}
+	if (event_pct) {
+		struct event_log *log = &tinfo[thread].events;
+
+		fprintf(f, "# events: below %u%% of the running peak, %u samples "
+		        "of context\n", log->pct, log->ncontext);
+		fprintf(f, "# %llu samples, peak %llu, %zu events, %llu dropped, "
+		        "lost work %llu\n", log->samples, log->peak, log->n,
+		        log->dropped, log->lost);
+		fprintf(f, "# columns: start_ns duration_ns first_sample samples "
+		        "lost min peak, %u before, %u after (-1: none)\n",
+		        log->ncontext, log->ncontext);
+	}
+	if (tinfo[thread].pmu.n) {
+		struct pmu *pmu = &tinfo[thread].pmu;
+		int i;
+
+		fprintf(f, "# columns: time count");
+		for (i = 0; i < pmu->n; i++)
+			fprintf(f, " %s", pmu->name[i]);
+		fprintf(f, "\n");
+		fprintf(f, "# pmu read overhead %g ticks (%g ns) per sample\n",
+		        pmu->overhead, pmu->overhead / ticksperns);
+	}
 	if (ignore_wire_failures)
 		fprintf(f, "# Warning: not wired to this core; results may be flaky\n");
 	osinfo(f, thread);
 }
 
-static void ftq_mdelay(unsigned long msec)
+/* what a binary file says about the run; ftqbin.c does the layout */
+static void binary_header(struct ftqbin_header *hdr, int thread)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->thread = thread;
+	hdr->core = tinfo[thread].core;
+	hdr->numsamples = numsamples;
+	hdr->interval = interval;
+	hdr->frequency = 1e9 / interval;
+	hdr->ticksperns = ticksperns;
+	hdr->total_count = total_count;
+	hdr->max_work = max_work;
+	hdr->node = tinfo[thread].region.node;
+	hdr->pagesize = tinfo[thread].region.pagesize;
+	hdr->npmc = tinfo[thread].pmu.n;
+	hdr->flags = (show_overrun ? FTQBIN_OVRTEXT : 0)
+	             | (use_pack ? FTQBIN_PACKED : 0);
+}
+
+/*
+ * Binary output: the same comment header as the text files, as a blob,
+ * then the raw samples. ftqdump turns it back into text.
+ */
+static void write_binary(int fd, int thread)
+{
+	struct ftqbin_header hdr;
+	char *text;
+	size_t textsize;
+	FILE *f;
+
+	f = open_memstream(&text, &textsize);
+	assert(f);
+	header(f, thread);
+	fclose(f);
+
+	binary_header(&hdr, thread);
+	if (ftqbin_write(fd, &hdr, text, textsize, tinfo[thread].region.samples,
+	                 (unsigned long long *)tinfo[thread].pmcregion.samples,
+	                 (struct overrun *)tinfo[thread].ovrregion.samples) < 0) {
+		perror("can not write binary file");
+		exit(EXIT_FAILURE);
+	}
+	free(text);
+}
+
+/*
+ * The text of a mapped file, in the room before its samples. A reader
+ * may look at any time, so the old text goes before the new goes in.
+ */
+static void map_text(int thread)
+{
+	struct ftqbin_header *hdr = tinfo[thread].maphdr;
+	char *text;
+	size_t textsize;
+	FILE *f;
+
+	f = open_memstream(&text, &textsize);
+	assert(f);
+	header(f, thread);
+	fclose(f);
+	/* osinfo can go on; keep whole lines */
+	if (textsize > hdr->dataoff - hdr->hdrsize) {
+		textsize = hdr->dataoff - hdr->hdrsize;
+		while (textsize && text[textsize - 1] != '\n')
+			textsize--;
+	}
+	__atomic_store_n(&hdr->textsize, 0, __ATOMIC_RELEASE);
+	memcpy((char *)hdr + hdr->hdrsize, text, textsize);
+	__atomic_store_n(&hdr->textsize, textsize, __ATOMIC_RELEASE);
+	free(text);
+}
+
+/*
+ * -m: the thread's .bin file is its memory for the samples, overrun
+ * records and counters, laid out as ftqbin_write would have it. The
+ * header and the text go in before the run, and the loops count the
+ * samples in the header as they store them, so the file is whole at
+ * any point; map_finish() just adds the totals.
+ */
+static void map_output(int thread)
+{
+	struct threadinfo *ti = &tinfo[thread];
+	struct ftqbin_header hdr;
+	char fname[512], *map;
+	uint64_t size;
+
+	snprintf(fname, sizeof(fname), "%s_%d.bin", outname, thread);
+	binary_header(&hdr, thread);
+	size = ftqbin_live_layout(&hdr, LIVE_TEXT_ROOM, has_overrun());
+	if (map_samples_file(&ti->mapregion, fname, size) < 0) {
+		fprintf(stderr, "thread %d: can not map %s\n", thread, fname);
+		exit(EXIT_FAILURE);
+	}
+	map = (char *)ti->mapregion.samples;
+	ti->region = ti->mapregion;
+	ti->region.samples = (struct sample *)(map + hdr.dataoff);
+	ti->region.size = numsamples * sizeof(struct sample);
+	if (hdr.ovroff)
+		ti->ovrregion.samples = (struct sample *)(map + hdr.ovroff);
+	if (hdr.pmcoff)
+		ti->pmcregion.samples = (struct sample *)(map + hdr.pmcoff);
+	/* now that region says where the samples are */
+	hdr.node = ti->region.node;
+	hdr.pagesize = ti->region.pagesize;
+
+	/* the magic last: until it is there, it is not an ftq file */
+	ti->maphdr = (struct ftqbin_header *)map;
+	memcpy(map + sizeof(hdr.magic), (char *)&hdr + sizeof(hdr.magic),
+	       sizeof(hdr) - sizeof(hdr.magic));
+	map_text(thread);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(map, hdr.magic, sizeof(hdr.magic));
+}
+
+static void map_finish(int thread)
+{
+	struct ftqbin_header *hdr = tinfo[thread].maphdr;
+
+	hdr->total_count = total_count;
+	hdr->max_work = max_work;
+	map_text(thread);
+}
+
+/*
+ * -F: the child mapped the file, not the parent. Map its header and text
+ * again to finish it in place; the samples stay where the child put them,
+ * and the file is already its final size.
+ */
+static void map_reopen(int thread)
+{
+	struct ftqbin_header hdr;
+	char fname[512];
+	void *map;
+	int fd;
+
+	snprintf(fname, sizeof(fname), "%s_%d.bin", outname, thread);
+	binary_header(&hdr, thread);
+	ftqbin_live_layout(&hdr, LIVE_TEXT_ROOM, has_overrun());
+	fd = open(fname, O_RDWR);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	map = mmap(NULL, hdr.dataoff, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	if (memcmp(map, hdr.magic, sizeof(hdr.magic))
+	    || ((struct ftqbin_header *)map)->dataoff != hdr.dataoff) {
+		fprintf(stderr, "%s: not the file thread %d left\n", fname, thread);
+		exit(EXIT_FAILURE);
+	}
+	tinfo[thread].maphdr = map;
+}
+
+/*
+ * Streaming. Each measuring thread pushes into its own ring; this thread
+ * empties them into the files. It runs on a housekeeping core, not one
+ * being measured, and sleeps when there is nothing to do.
+ */
+struct streamstat {
+	int headed;
+	unsigned long long written;
+	ticks base;
+};
+static struct streamstat *streamstats;
+static pthread_t drainer;
+
+static size_t drain_one(int thread)
+{
+	struct streamstat *st = &streamstats[thread];
+	FILE *f = streamfiles[thread];
+	char buf[4096], *p = buf;
+	struct sample *s;
+	size_t i, n;
+
+	n = ring_peek(&rings[thread], &s);
+	if (!n)
+		return 0;
+	/* its region is filled in before the first push */
+	if (!st->headed) {
+		header(f, thread);
+		st->headed = 1;
+	}
+	if (!st->written)
+		st->base = s[0].ticklast;
+	for (i = 0; i < n; i++) {
+		if (p + 64 > buf + sizeof(buf)) {
+			fwrite(buf, 1, p - buf, f);
+			p = buf;
+		}
+		p = format_sample(p, (ticks)((s[i].ticklast - st->base) / ticksperns),
+		                  s[i].count);
+	}
+	fwrite(buf, 1, p - buf, f);
+	st->written += n;
+	ring_done(&rings[thread], n);
+	return n;
+}
+
+static void *drain_thread(void *arg)
+{
+	struct timespec nap = {0, 1000000};
+	size_t got;
+	int i, last = 0;
+
+	if (housekeeping_core >= 0)
+		wireme(housekeeping_core);
+
+	while (!last) {
+		/* read the flag first, so a final pass sees everything */
+		last = drain_done;
+		do {
+			got = 0;
+			for (i = 0; i < numthreads; i++)
+				got += drain_one(i);
+		} while (got);
+		if (!last)
+			nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+static int measuring_on(int cpu)
+{
+	int i;
+
+	for (i = 0; i < numthreads; i++)
+		if (tinfo[i].core == cpu)
+			return 1;
+	return 0;
+}
+
+/*
+ * For the threads that are not measuring: drain and irq sampler. The
+ * last cpu we may use and are not measuring on, and not an isolated one
+ * if there is a choice.
+ */
+static void pick_housekeeping(const char *who)
 {
-	ticks start, end, now;
+	int *all, n, i;
+
+	if (housekeeping_core >= 0 || !pin_threads)
+		return;
+	all = calloc(CPU_LIST_MAX, sizeof(*all));
+	assert(all);
+	n = cpu_list(NULL, all, CPU_LIST_MAX);
+	if (n < 0) {
+		/* no list from the OS: cores 0 to numthreads - 1 are taken */
+		if (numthreads < get_num_cores())
+			housekeeping_core = get_num_cores() - 1;
+	}
+	for (i = n - 1; i >= 0; i--) {
+		if (measuring_on(all[i]))
+			continue;
+		if (!cpu_isolation(all[i])) {
+			housekeeping_core = all[i];
+			break;
+		}
+		if (housekeeping_core < 0)
+			housekeeping_core = all[i];
+	}
+	free(all);
+	if (housekeeping_core < 0)
+		fprintf(stderr, "WARNING: no core left for the %s thread; it "
+		        "will share with the measurement\n", who);
+}
 
-	start = getticks();
-	end = start + (ticks)(msec * ticksperns * 1000000);
+static void stop_run(int sig)
+{
+	stop = 1;
+}
+
+static void start_stream(void)
+{
+	static char fname[8192];
+	int i, rc;
+
+	if (ringsize & (ringsize - 1)) {
+		fprintf(stderr, "ring size must be a power of 2\n");
+		exit(EXIT_FAILURE);
+	}
+	pick_housekeeping("drain");
+	rings = calloc(numthreads, sizeof(*rings));
+	streamfiles = calloc(numthreads, sizeof(*streamfiles));
+	streamstats = calloc(numthreads, sizeof(*streamstats));
+	assert(rings && streamfiles && streamstats);
+	/* ftq_thread allocates the ring buffers themselves */
+	for (i = 0; i < numthreads; i++) {
+		rings[i].mask = ringsize - 1;
+		if (use_stdout) {
+			streamfiles[i] = stdout;
+		} else {
+			sprintf(fname, "%s_%d.dat", outname, i);
+			streamfiles[i] = fopen(fname, "w");
+			if (!streamfiles[i]) {
+				perror("can not create file");
+				exit(EXIT_FAILURE);
+			}
+		}
+		setvbuf(streamfiles[i], NULL, _IOFBF, 1 << 20);
+	}
+
+	signal(SIGINT, stop_run);
+	signal(SIGTERM, stop_run);
+
+	rc = pthread_create(&drainer, NULL, drain_thread, NULL);
+	if (rc) {
+		fprintf(stderr, "ERROR: pthread_create() failed.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* measurement is over: empty the rings and write the totals. */
+static void finish_stream(void)
+{
+	unsigned long long taken = 0, dropped = 0, max = 0, d;
+	int i;
+
+	for (i = 0; i < numthreads; i++)
+		total_count += tinfo[i].total_count;
+	drain_done = 1;
+	if (pthread_join(drainer, NULL)) {
+		fprintf(stderr, "ERROR: pthread_join() failed.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < numthreads; i++) {
+		taken += streamstats[i].written + ring_dropped(&rings[i]);
+		dropped += ring_dropped(&rings[i]);
+		if (tinfo[i].hist.count.max > max)
+			max = tinfo[i].hist.count.max;
+	}
+	max_work = max * taken;
+	merge_hists();
+
+	for (i = 0; i < numthreads; i++) {
+		FILE *f = streamfiles[i];
+
+		d = ring_dropped(&rings[i]);
+		if (!streamstats[i].headed)
+			header(f, i);
+		fprintf(f, "# Total count is %llu\n", total_count);
+		fprintf(f, "# Max possible work is %llu\n", max_work);
+		fprintf(f, "# Fraction is %g\n", (1.0 * total_count) / max_work);
+		fprintf(f, "# Samples written %llu, dropped %llu\n",
+		        streamstats[i].written, d);
+		write_hist(f, "", &tinfo[i].hist);
+		if (numthreads > 1)
+			write_hist(f, "all threads: ", &all_hist);
+		if (d)
+			fprintf(f, "# Warning: ring overflowed; timestamps have gaps\n");
+		if (f != stdout)
+			fclose(f);
+		else
+			fflush(f);
+	}
+
+	fprintf(stderr, "Ticks per ns: %f\n", ticksperns);
+	fprintf(stderr, "Sample frequency is %f\n", 1e9 / interval);
+	fprintf(stderr, "Total count is %llu\n", total_count);
+	fprintf(stderr, "Max possible work is %llu\n", max_work);
+	fprintf(stderr, "Fraction is %g\n", (1.0 * total_count) / max_work);
+	fprintf(stderr, "Samples taken %llu, dropped %llu\n", taken, dropped);
+	write_hist(stderr, "all threads: ", &all_hist);
+}
+
+/* Welch PSD straight from the samples, as octave's pwelch would. */
+static void write_psd(int thread)
+{
+	char fname[512];
+	struct welch_opts opts;
+	struct welch_psd psd;
+	FILE *fp;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.fs = 1e9 / interval;
+	/* every thread is doing its own */
+	opts.nthreads = 1;
+	if (welch_samples(tinfo[thread].region.samples, numsamples,
+	                  &opts, &psd) < 0) {
+		fprintf(stderr, "thread %d: no PSD\n", thread);
+		return;
+	}
+	snprintf(fname, sizeof(fname), "%s_%d.psd.csv", outname, thread);
+	fp = fopen(fname, "w");
+	if (!fp) {
+		perror("can not create file");
+		exit(EXIT_FAILURE);
+	}
+	welch_write_csv(fp, &psd);
+	fclose(fp);
+	welch_free(&psd);
+}
+
+static void write_text(int fd, int thread)
+{
+	struct threadinfo *ti = &tinfo[thread];
+	struct sample *samples = ti->region.samples;
+	char *text;
+	size_t textsize;
+	FILE *f;
+
+	f = open_memstream(&text, &textsize);
+	assert(f);
+	header(f, thread);
+	fclose(f);
+	if (write_all(fd, text, textsize) < 0
+	    || write_samples_cols(fd, samples, show_overrun
+	                          ? (struct overrun *)ti->ovrregion.samples : NULL,
+	                          (unsigned long long *)ti->pmcregion.samples,
+	                          ti->pmu.n, numsamples, samples[0].ticklast,
+	                          ticksperns) < 0) {
+		perror("can not write file");
+		exit(EXIT_FAILURE);
+	}
+	free(text);
+}
+
+/* event mode: one line per event, times since the common start */
+static void write_events(int fd, int thread)
+{
+	struct event_log *log = &tinfo[thread].events;
+	struct event *e;
+	char *text;
+	size_t textsize, i;
+	unsigned int j;
+	FILE *f;
 
+	f = open_memstream(&text, &textsize);
+	assert(f);
+	header(f, thread);
+	for (i = 0; i < log->n; i++) {
+		e = &log->events[i];
+		fprintf(f, "%lld %lld %llu %llu %llu %llu %llu",
+		        (long long)((long long)(e->start - epoch) / ticksperns),
+		        (long long)((e->end - e->start) / ticksperns), e->first,
+		        e->nsamples, e->lost, e->min, e->peak);
+		/* missing context is at the start of the run, or the end */
+		for (j = e->nbefore; j < log->ncontext; j++)
+			fprintf(f, " -1");
+		for (j = 0; j < e->nbefore; j++)
+			fprintf(f, " %llu", e->before[j]);
+		for (j = 0; j < e->nafter; j++)
+			fprintf(f, " %llu", e->after[j]);
+		for (j = e->nafter; j < log->ncontext; j++)
+			fprintf(f, " -1");
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	if (write_all(fd, text, textsize) < 0) {
+		perror("can not write file");
+		exit(EXIT_FAILURE);
+	}
+	free(text);
+}
+
+/*
+ * Trigger mode: the segments, as ordinary sample lines with the time
+ * since the common start, so they line up across threads; then the
+ * summaries in their own file.
+ */
+static void write_trigger(int fd, int thread)
+{
+	struct trig *t = &tinfo[thread].trig;
+	struct trig_segment *seg;
+	struct trig_summary *sum;
+	char fname[512];
+	char *text;
+	size_t textsize, i;
+	FILE *f;
+
+	f = open_memstream(&text, &textsize);
+	assert(f);
+	header(f, thread);
+	fclose(f);
+	if (write_all(fd, text, textsize) < 0)
+		goto bad;
+	free(text);
+	for (i = 0; i < t->nsegs; i++) {
+		seg = &t->segs[i];
+		if (dprintf(fd, "# segment %zu: sample %llu%s%s, samples %llu to "
+		            "%llu\n", i, seg->trigger,
+		            seg->reason & TRIG_LOW ? ", low" : "",
+		            seg->reason & TRIG_LATE ? ", late" : "", seg->first,
+		            seg->first + seg->n - 1) < 0
+		    || write_samples(fd, seg->samples, seg->n, epoch,
+		                     ticksperns) < 0)
+			goto bad;
+	}
+
+	snprintf(fname, sizeof(fname), "%s_%d.sum", outname, thread);
+	f = fopen(fname, "w");
+	if (!f)
+		goto bad;
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+	header(f, thread);
+	fprintf(f, "# columns: time min mean max\n");
+	for (i = 0; i < t->nsums; i++) {
+		sum = &t->sums[i];
+		fprintf(f, "%lld %llu %g %llu\n",
+		        (long long)((long long)(sum->start - epoch) / ticksperns),
+		        sum->min, (double)sum->sum / sum->n, sum->max);
+	}
+	if (fclose(f))
+		goto bad;
+	return;
+bad:
+	perror("can not write file");
+	exit(EXIT_FAILURE);
+}
+
+/* the last thread to finish measuring sums up for everyone. */
+static void summarize(void)
+{
+	unsigned long long samples = 0;
+	int j;
+
+	for (j = 0; j < numthreads; j++) {
+		total_count += tinfo[j].total_count;
+		/* for FWQ, the least ticks any sample took */
+		if (fwq_units ? !j || tinfo[j].max_count < max_work
+		    : tinfo[j].max_count > max_work)
+			max_work = tinfo[j].max_count;
+		/* event and trigger runs can be stopped early */
+		samples += event_pct ? tinfo[j].events.samples
+		           : use_trigger ? tinfo[j].trig.samples : numsamples;
+	}
+	max_work *= samples;
+	merge_hists();
+	unfinished = 0;
+
+	fprintf(stderr, "Ticks per ns: %f\n", ticksperns);
+	if (fwq_units) {
+		fprintf(stderr, "Work per sample is %llu units\n", fwq_units);
+		fprintf(stderr, "Total ticks is %llu\n", total_count);
+		fprintf(stderr, "Min possible ticks is %llu\n", max_work);
+		fprintf(stderr, "Fraction is %g\n", (1.0 * max_work) / total_count);
+	} else {
+		fprintf(stderr, "Sample frequency is %f\n", 1e9 / interval);
+		fprintf(stderr, "Total count is %llu\n", total_count);
+		fprintf(stderr, "Max possible work is %llu\n", max_work);
+		fprintf(stderr, "Fraction is %g\n", (1.0 * total_count) / max_work);
+	}
+	write_hist(stderr, "all threads: ", &all_hist);
+}
+
+/*
+ * Measurement is over, so now every thread writes its own files, in
+ * parallel, rather than the main thread doing them one at a time.
+ */
+static void thread_peak(int thread)
+{
+	/* the loops kept track, so no walk over the samples */
+	if (fwq_units)
+		tinfo[thread].max_count = tinfo[thread].hist.count.min;
+	else
+		tinfo[thread].max_count = tinfo[thread].hist.count.max;
+	if (has_overrun())
+		sum_overrun(thread);
+}
+
+static void write_output(int thread)
+{
+	char fname[512];
+	int fd;
+
+	thread_peak(thread);
+	if (pthread_barrier_wait(&done_barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+		summarize();
+	pthread_barrier_wait(&done_barrier);
+
+	if (use_map) {
+		if (use_procs)
+			map_reopen(thread);
+		map_finish(thread);
+		if (use_psd)
+			write_psd(thread);
+		return;
+	}
+	if (use_stdout) {
+		fd = 1;
+	} else {
+		snprintf(fname, sizeof(fname), "%s_%d.%s", outname, thread,
+		         use_binary ? "bin" : event_pct ? "events"
+		         : use_trigger ? "trig" : "dat");
+		fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			perror("can not create file");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (use_binary)
+		write_binary(fd, thread);
+	else if (event_pct)
+		write_events(fd, thread);
+	else if (use_trigger)
+		write_trigger(fd, thread);
+	else
+		write_text(fd, thread);
+	if (fd != 1)
+		close(fd);
+
+	if (use_psd && !use_stdout)
+		write_psd(thread);
+}
+
+/*
+ * Everyone starts at the same tick, and quantum k on every thread is
+ * [epoch + k * interval, epoch + (k + 1) * interval), so sample i covers
+ * the same wall-clock window on every core. This assumes the tick
+ * counters are synchronized across cores, as invariant TSCs are.
+ */
+static ticks start_together(int thread_num)
+{
+	ticks now;
+
+	if (__atomic_add_fetch(&start->ready, 1, __ATOMIC_ACQ_REL)
+	    == numthreads) {
+		epoch = readticks() + (ticks)((START_MARGIN_MSEC + delay_msec)
+		                             * ticksperns * 1000000);
+		start->epoch = epoch;
+		if (tel)
+			tel->epoch = epoch;
+		__atomic_store_n(&start->hounds, 1, __ATOMIC_RELEASE);
+	}
+	while (!__atomic_load_n(&start->hounds, __ATOMIC_ACQUIRE)) ;
 	do {
-		now = getticks();
-	} while (now < end || (now > start && end < start));
+		now = readticks();
+	} while (now < start->epoch);
+	tinfo[thread_num].skew = now - start->epoch;
+	return start->epoch;
+}
+
+/*
+ * Trigger mode memory, in one region: the segments and their samples,
+ * the ring and the summaries. Summaries for the whole run if it has an
+ * end, else DEFAULT_SUMMARIES of them.
+ */
+static size_t trigger_size(struct trig *t)
+{
+	t->pct = trig_pct;
+	t->late = trig_late_ns * ticksperns;
+	t->pre = trig_pre;
+	t->post = trig_post;
+	t->decimate = trig_decimate;
+	for (t->mask = 1; t->mask < t->pre + 1; t->mask <<= 1)
+		;
+	t->mask--;
+	t->maxsegs = DEFAULT_SEGMENTS;
+	t->maxsums = numsamples ? numsamples / t->decimate + 1
+	             : DEFAULT_SUMMARIES;
+	return t->maxsegs * (sizeof(struct trig_segment)
+	                     + (t->pre + 1 + t->post) * sizeof(struct sample))
+	       + (t->mask + 1) * sizeof(struct sample)
+	       + t->maxsums * sizeof(struct trig_summary);
+}
+
+static void trigger_setup(struct trig *t, char *p)
+{
+	size_t i;
+
+	t->segs = (struct trig_segment *)p;
+	p += t->maxsegs * sizeof(struct trig_segment);
+	for (i = 0; i < t->maxsegs; i++) {
+		t->segs[i].samples = (struct sample *)p;
+		p += (t->pre + 1 + t->post) * sizeof(struct sample);
+	}
+	t->ring = (struct sample *)p;
+	p += (t->mask + 1) * sizeof(struct sample);
+	t->sums = (struct trig_summary *)p;
+}
+
+/* the samples, events or trigger memory each thread keeps */
+static size_t region_size(int thread)
+{
+	if (use_stream)
+		return sizeof(struct sample) * ringsize;
+	if (event_pct)
+		return sizeof(struct event) * DEFAULT_EVENTS;
+	if (use_trigger)
+		return trigger_size(&tinfo[thread].trig);
+	return sizeof(struct sample) * numsamples;
+}
+
+/*
+ * -F: where a child leaves its results for the parent. The region, then
+ * the overrun records, then room for the most counter columns.
+ */
+static size_t results_size(int thread, size_t *ovroff, size_t *pmcoff)
+{
+	size_t size = region_size(thread);
+
+	*ovroff = size;
+	if (has_overrun())
+		size += numsamples * sizeof(struct overrun);
+	*pmcoff = size;
+	if (pmu_events)
+		size += numsamples * PMU_MAX * sizeof(unsigned long long);
+	return size;
+}
+
+/* in the child, at the end */
+static void publish_results(int thread)
+{
+	struct threadinfo *ti = &tinfo[thread];
+	size_t ovroff, pmcoff;
+
+	results_size(thread, &ovroff, &pmcoff);
+	memcpy(results[thread], ti->region.samples, ovroff);
+	if (has_overrun())
+		memcpy(results[thread] + ovroff, ti->ovrregion.samples,
+		       pmcoff - ovroff);
+	if (pmu_events)
+		memcpy(results[thread] + pmcoff, ti->pmcregion.samples,
+		       numsamples * ti->pmu.n * sizeof(unsigned long long));
+}
+
+/* in the parent: point the child's tinfo at what it left */
+static void collect_results(int thread)
+{
+	struct threadinfo *ti = &tinfo[thread];
+	size_t ovroff, pmcoff;
+
+	results_size(thread, &ovroff, &pmcoff);
+	ti->region.samples = (struct sample *)results[thread];
+	ti->ovrregion.samples = (struct sample *)(results[thread] + ovroff);
+	ti->pmcregion.samples = (struct sample *)(results[thread] + pmcoff);
+	memset(&ti->kregion, 0, sizeof(ti->kregion));
+	memset(&ti->membuf, 0, sizeof(ti->membuf));
+	if (event_pct)
+		ti->events.events = (struct event *)results[thread];
+	if (use_trigger)
+		trigger_setup(&ti->trig, results[thread]);
 }
 
 static void *ftq_thread(void *arg)
 {
 	/* thread number, zero based. */
 	int thread_num = (uintptr_t) arg;
-	int offset;
-	ticks tickinterval;
+	size_t samples_size;
+	ticks tickinterval, t0;
 	unsigned long total_count = 0;
+	/* the kernel loops that update -M and -m as they go */
+	int live = tel || use_map;
 
 	/* core # is thread # for some OSs (not Akaros pth 2LS) */
 	if (pin_threads)
-		wireme(thread_num);
+		wireme(tinfo[thread_num].core);
 
 	if (set_realtime) {
 		int cores = get_num_cores();
@@ -109,30 +1190,544 @@ static void *ftq_thread(void *arg)
 			set_sched_realtime();
 	}
 
-	offset = thread_num * numsamples;
+	/*
+	 * counters are per thread, so they are opened here; first, since
+	 * a mapped file has room for their columns
+	 */
+	if (pmu_events) {
+		struct threadinfo *ti = &tinfo[thread_num];
+
+		if (pmu_open(&ti->pmu, pmu_events) < 0) {
+			fprintf(stderr, "thread %d: can not open counters\n",
+			        thread_num);
+			exit(EXIT_FAILURE);
+		}
+		ti->pmu.overhead = pmu_read_cost(&ti->pmu);
+	}
+
+	/* now that we are wired, so that the memory is local; once a sweep */
+	if (use_map)
+		map_output(thread_num);
+	samples_size = region_size(thread_num);
+	if (!tinfo[thread_num].region.samples
+	    && allocate_samples(&tinfo[thread_num].region, samples_size) < 0) {
+		fprintf(stderr, "thread %d: can not allocate samples\n",
+		        thread_num);
+		exit(EXIT_FAILURE);
+	}
+	if (use_stream)
+		rings[thread_num].buf = tinfo[thread_num].region.samples;
+	if (has_overrun() && !tinfo[thread_num].ovrregion.samples
+	    && allocate_samples(&tinfo[thread_num].ovrregion,
+	                        numsamples * sizeof(struct overrun)) < 0) {
+		fprintf(stderr, "thread %d: can not allocate overrun records\n",
+		        thread_num);
+		exit(EXIT_FAILURE);
+	}
+	if (pmu_events && !tinfo[thread_num].pmcregion.samples
+	    && allocate_samples(&tinfo[thread_num].pmcregion, numsamples
+	                        * tinfo[thread_num].pmu.n
+	                        * sizeof(unsigned long long)) < 0) {
+		fprintf(stderr, "thread %d: can not allocate counters\n",
+		        thread_num);
+		exit(EXIT_FAILURE);
+	}
+	if (use_trigger)
+		trigger_setup(&tinfo[thread_num].trig,
+		              (char *)tinfo[thread_num].region.samples);
+	if (event_pct) {
+		struct event_log *log = &tinfo[thread_num].events;
+
+		log->events = (struct event *)tinfo[thread_num].region.samples;
+		log->max = DEFAULT_EVENTS;
+		log->pct = event_pct;
+		log->ncontext = event_context;
+	}
+
+	/* memory kernels get their own buffer, local to this core too */
+	if (kernel->level) {
+		struct threadinfo *ti = &tinfo[thread_num];
+
+		ti->membuf.size = kernel_bufsize(kernel);
+		if (!ti->kregion.samples
+		    && allocate_samples(&ti->kregion, kbuf_size) < 0) {
+			fprintf(stderr, "thread %d: can not allocate kernel buffer\n",
+			        thread_num);
+			exit(EXIT_FAILURE);
+		}
+		ti->membuf.buf = (char *)ti->kregion.samples;
+		kernel->init(&ti->membuf, thread_num + 1);
+	}
+
 	tickinterval = interval * ticksperns;
 
-	while (!hounds) ;
+	if (use_stream || use_trigger || event_pct || pmu_events)
+		histograms = &tinfo[thread_num].hist;
+	if (use_map)
+		sample_progress = &tinfo[thread_num].maphdr->done;
+	if (tel) {
+		telemetry = &tel->threads[thread_num];
+		telemetry->thread = thread_num;
+		telemetry->core = tinfo[thread_num].core;
+	}
+
+	t0 = start_together(thread_num);
 
-	ftq_mdelay(delay_msec);
+	if (use_stream)
+		total_count = stream_loops(&rings[thread_num], numsamples,
+		                           tickinterval, t0, &stop);
+	else if (use_trigger)
+		total_count = trigger_loops(&tinfo[thread_num].trig, numsamples,
+		                            tickinterval, t0, &stop);
+	else if (event_pct)
+		total_count = event_loops(&tinfo[thread_num].events, numsamples,
+		                          tickinterval, t0, &stop);
+	else if (pmu_events)
+		total_count = pmu_loops(tinfo[thread_num].region.samples,
+		                        (unsigned long long *)
+		                        tinfo[thread_num].pmcregion.samples,
+		                        numsamples, tickinterval, t0,
+		                        &tinfo[thread_num].pmu);
+	else if (fwq_units)
+		total_count = kernel->fwq[live][timer - timers](
+			tinfo[thread_num].region.samples, numsamples, fwq_units,
+			t0, kernel->level ? &tinfo[thread_num].membuf : NULL);
+	else
+		total_count = kernel->loops[live][timer - timers](
+			tinfo[thread_num].region.samples,
+			(struct overrun *)tinfo[thread_num].ovrregion.samples,
+			numsamples, tickinterval, t0,
+			kernel->level ? &tinfo[thread_num].membuf : NULL);
+	tinfo[thread_num].total_count = total_count;
+	if (!histograms)
+		hist_samples(&tinfo[thread_num].hist,
+		             tinfo[thread_num].region.samples, fwq_units ? NULL
+		             : (struct overrun *)tinfo[thread_num].ovrregion.samples,
+		             numsamples);
 
-	total_count = main_loops(samples, numsamples, tickinterval, offset);
+	/* a sweep writes its archive from the main thread */
+	if (use_procs)
+		publish_results(thread_num);
+	else if (!use_stream && !archive_name)
+		write_output(thread_num);
 
 	return (void*)total_count;
 }
 
+/*
+ * The cpus to put the threads on: the -c list, or all the ones we may
+ * use. -c without -t means a thread on each.
+ */
+static void pick_cpus(int use_threads)
+{
+	cpus = calloc(CPU_LIST_MAX, sizeof(*cpus));
+	assert(cpus);
+	ncpus = cpu_list(cpu_arg, cpus, CPU_LIST_MAX);
+	if (ncpus < 0 && cpu_arg) {
+		fprintf(stderr, "ERROR: can not use cpu list %s.\n", cpu_arg);
+		exit(EXIT_FAILURE);
+	}
+	if (cpu_arg && !use_threads)
+		numthreads = ncpus;
+}
+
+/*
+ * Thread i on the i-th cpu, or on core i if the OS can not list them.
+ * Only -w lets two threads share a cpu.
+ */
+static void place_threads(void)
+{
+	int i;
+
+	if (pin_threads && ncpus > 0 && ncpus < numthreads
+	    && !ignore_wire_failures) {
+		fprintf(stderr, "ERROR: %d threads, but only %d cpus to put them on.\n",
+		        numthreads, ncpus);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < numthreads; i++) {
+		tinfo[i].core = -1;
+		if (!pin_threads)
+			continue;
+		tinfo[i].core = ncpus > 0 ? cpus[i % ncpus] : i;
+		tinfo[i].isolation = cpu_isolation(tinfo[i].core);
+	}
+}
+
+/*
+ * The telemetry file: a header, then a slot per thread. It is left
+ * behind at the end, with done set, so ftqtop can still read it.
+ */
+static void start_telemetry(void)
+{
+	size_t size = sizeof(*tel) + numthreads * sizeof(tel->threads[0]);
+	int fd;
+
+	fd = open(tel_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(tel_path);
+		exit(EXIT_FAILURE);
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("telemetry: ftruncate");
+		exit(EXIT_FAILURE);
+	}
+	tel = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tel == MAP_FAILED) {
+		perror("telemetry: mmap");
+		exit(EXIT_FAILURE);
+	}
+	tel->version = TEL_VERSION;
+	tel->nthreads = numthreads;
+	tel->pid = getpid();
+	tel->ticksperns = ticksperns;
+	tel->interval = interval;
+	snprintf(tel->kernel, sizeof(tel->kernel), "%s", kernel->name);
+	/* the magic last: readers take the file once it is there */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(tel->magic, TEL_MAGIC, sizeof(tel->magic));
+}
+
+static void *shared_alloc(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("shared mmap");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void *merge_thread(void *arg)
+{
+	write_output((uintptr_t)arg);
+	return NULL;
+}
+
+/*
+ * -F: a process per thread, so that nothing mm-wide in one (TLB
+ * shootdowns, mmap_lock, page table updates) reaches the others, as
+ * with an MPI job. Each child runs ftq_thread and copies its results to
+ * shared memory at the end; the parent then writes the usual files
+ * from them, a thread per file as always.
+ */
+static void run_processes(void)
+{
+	size_t ovroff, pmcoff;
+	pthread_t *threads;
+	pid_t *pids;
+	pid_t pid;
+	int i, j, status;
+
+	results = calloc(numthreads, sizeof(*results));
+	pids = calloc(numthreads, sizeof(*pids));
+	threads = calloc(numthreads, sizeof(*threads));
+	assert(results && pids && threads);
+	for (i = 0; i < numthreads; i++)
+		results[i] = shared_alloc(results_size(i, &ovroff, &pmcoff));
+	fflush(NULL);
+	for (i = 0; i < numthreads; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (!pids[i]) {
+			ftq_thread((void *)(intptr_t) i);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	/* one failing would leave the rest waiting at the start forever */
+	for (i = 0; i < numthreads; i++) {
+		pid = wait(&status);
+		if (pid < 0 && errno == EINTR) {
+			i--;
+			continue;
+		}
+		if (pid < 0) {
+			perror("wait");
+			exit(EXIT_FAILURE);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "ERROR: a measuring process failed.\n");
+			for (j = 0; j < numthreads; j++)
+				kill(pids[j], SIGKILL);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	epoch = start->epoch;
+	for (i = 0; i < numthreads; i++)
+		collect_results(i);
+	for (i = 0; i < numthreads; i++)
+		if (pthread_create(&threads[i], NULL, merge_thread,
+		                   (void *)(intptr_t) i)) {
+			fprintf(stderr, "ERROR: pthread_create() failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < numthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(pids);
+}
+
+static int count_list(const char *s, int sep)
+{
+	int n = 1;
+
+	for (; *s; s++)
+		n += *s == sep;
+	return n;
+}
+
+/* the whole run, for the front of the archive */
+static char *sweep_meta(int argc, char **argv, size_t *size)
+{
+	char *text;
+	FILE *f;
+	int i;
+
+	f = open_memstream(&text, size);
+	assert(f);
+	fprintf(f, "# ftq sweep:");
+	for (i = 0; i < argc; i++)
+		fprintf(f, " %s", argv[i]);
+	fprintf(f, "\n# frequencies %s, threads %s, kernels %s, cpus %s\n",
+	        freq_arg, thread_arg, kernel_arg, cpu_arg ? cpu_arg : "all");
+	fprintf(f, "# %zu samples per thread per cell\n", numsamples);
+	fprintf(f, "# Ticks per ns: %g\n", ticksperns);
+	fprintf(f, "# timer %s: %s, %g ns per read, %g ns p99 between reads\n",
+	        timer->name, timer->desc, timer->cost, timer->jitter);
+	osinfo(f, 0);
+	fclose(f);
+	return text;
+}
+
+/*
+ * One cell: numthreads threads of kernel at interval on the first cpus
+ * of the placement, then a binary file per thread into the archive.
+ */
+static void sweep_cell(int fd, int cell, const char *placement,
+                       struct ftqarc_entry **ent, size_t *nent)
+{
+	pthread_t *threads = calloc(numthreads, sizeof(*threads));
+	struct threadinfo *ti;
+	struct ftqarc_entry *e;
+	int64_t off;
+	int i;
+
+	assert(threads);
+	memset(start, 0, sizeof(*start));
+	total_count = max_work = 0;
+	place_threads();
+	for (i = 0; i < numthreads; i++) {
+		ti = &tinfo[i];
+		ti->skew = ti->total_count = ti->max_count = 0;
+		ti->caught = ti->overrun = ti->longest = 0;
+		ti->longest_at = 0;
+		memset(&ti->hist, 0, sizeof(ti->hist));
+	}
+	fprintf(stderr, "cell %d: %d threads, %s kernel, %g Hz, cpus %s\n",
+	        cell, numthreads, kernel->name, 1e9 / interval,
+	        placement ? placement : "all");
+	for (i = 0; i < numthreads; i++)
+		if (pthread_create(&threads[i], NULL, ftq_thread,
+		                   (void *)(intptr_t) i)) {
+			fprintf(stderr, "ERROR: pthread_create() failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < numthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < numthreads; i++)
+		thread_peak(i);
+	summarize();
+	*ent = realloc(*ent, (*nent + numthreads) * sizeof(**ent));
+	assert(*ent);
+	for (i = 0; i < numthreads; i++) {
+		off = ftqarc_align(fd);
+		if (off < 0) {
+			perror(archive_name);
+			exit(EXIT_FAILURE);
+		}
+		write_binary(fd, i);
+		e = &(*ent)[(*nent)++];
+		memset(e, 0, sizeof(*e));
+		e->off = off;
+		e->size = lseek(fd, 0, SEEK_CUR) - off;
+		e->cell = cell;
+		e->threads = numthreads;
+		e->thread = i;
+		e->core = tinfo[i].core;
+		e->interval = interval;
+		snprintf(e->kernel, sizeof(e->kernel), "%s", kernel->name);
+		snprintf(e->cpus, sizeof(e->cpus), "%s",
+		         placement ? placement : "all");
+	}
+}
+
+/*
+ * -A: every combination of the -f, -t, -k and -c lists (-c lists
+ * separated by /), in one process. Calibration and the timer are done
+ * once, and each thread slot's memory is allocated the first time it
+ * runs, where it first runs, and reused after that.
+ */
+static void run_sweep(int argc, char **argv)
+{
+	int nfreq = count_list(freq_arg, ','), nthr = count_list(thread_arg, ',');
+	int nker = count_list(kernel_arg, ','), nplace = 1;
+	unsigned long long *intervals = calloc(nfreq, sizeof(*intervals));
+	const struct kernel **kers = calloc(nker, sizeof(*kers));
+	int *thr = calloc(nthr, sizeof(*thr));
+	char **places, *fstr, *tstr, *kstr, *cstr = NULL, *tok, *end, *meta;
+	struct ftqarc_header hdr;
+	struct ftqarc_entry *ent = NULL;
+	size_t nent = 0, metasize;
+	int i, p, t, k, f, fd, maxthreads = 0, cell = 0;
+
+	if (cpu_arg)
+		nplace = count_list(cpu_arg, '/');
+	places = calloc(nplace, sizeof(*places));
+	assert(intervals && kers && thr && places);
+	fstr = strdup(freq_arg);
+	for (i = 0, tok = strtok(fstr, ","); tok; tok = strtok(NULL, ",")) {
+		f = strtol(tok, &end, 10);
+		if (f <= 0 || *end) {
+			fprintf(stderr, "ERROR: bad frequency %s.\n", tok);
+			exit(EXIT_FAILURE);
+		}
+		intervals[i++] = 1e9 / f;
+	}
+	free(fstr);
+	tstr = strdup(thread_arg);
+	for (i = 0, tok = strtok(tstr, ","); tok; tok = strtok(NULL, ",")) {
+		thr[i] = strtol(tok, &end, 10);
+		if (thr[i] <= 0 || *end) {
+			fprintf(stderr, "ERROR: bad thread count %s.\n", tok);
+			exit(EXIT_FAILURE);
+		}
+		if (thr[i] > maxthreads)
+			maxthreads = thr[i];
+		i++;
+	}
+	free(tstr);
+	kstr = strdup(kernel_arg);
+	for (i = 0, tok = strtok(kstr, ","); tok; tok = strtok(NULL, ",")) {
+		kers[i] = find_kernel(tok);
+		if (!kers[i])
+			kernel_usage();
+		if (kers[i]->supported && !kers[i]->supported()) {
+			fprintf(stderr, "ERROR: this cpu can not run the %s "
+			        "kernel.\n", kers[i]->name);
+			exit(EXIT_FAILURE);
+		}
+		if (kers[i]->level && kernel_bufsize(kers[i]) > kbuf_size)
+			kbuf_size = kernel_bufsize(kers[i]);
+		i++;
+	}
+	free(kstr);
+	/* places[] points into cstr, so it stays until the cells are done */
+	if (cpu_arg) {
+		cstr = strdup(cpu_arg);
+		for (i = 0, tok = strtok(cstr, "/"); tok; tok = strtok(NULL, "/"))
+			places[i++] = tok;
+	}
+	if (maxthreads < 1) {
+		fprintf(stderr, "ERROR: bad thread counts %s.\n", thread_arg);
+		exit(EXIT_FAILURE);
+	}
+
+	tinfo = calloc(maxthreads, sizeof(*tinfo));
+	cpus = calloc(CPU_LIST_MAX, sizeof(*cpus));
+	assert(tinfo && cpus);
+	pin_threads = 1;
+	fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(archive_name);
+		exit(EXIT_FAILURE);
+	}
+	meta = sweep_meta(argc, argv, &metasize);
+	if (ftqarc_start(fd, &hdr, meta, metasize) < 0) {
+		perror(archive_name);
+		exit(EXIT_FAILURE);
+	}
+	free(meta);
+
+	for (p = 0; p < nplace; p++) {
+		ncpus = cpu_list(places[p], cpus, CPU_LIST_MAX);
+		if (ncpus < 0 && places[p]) {
+			fprintf(stderr, "ERROR: can not use cpu list %s.\n",
+			        places[p]);
+			exit(EXIT_FAILURE);
+		}
+		for (t = 0; t < nthr; t++) {
+			if (ncpus > 0 && thr[t] > ncpus && !ignore_wire_failures) {
+				fprintf(stderr, "skipping %d threads on %d cpus\n",
+				        thr[t], ncpus);
+				continue;
+			}
+			numthreads = thr[t];
+			for (k = 0; k < nker; k++) {
+				kernel = kers[k];
+				for (f = 0; f < nfreq; f++) {
+					interval = intervals[f];
+					sweep_cell(fd, cell++, places[p], &ent, &nent);
+				}
+			}
+		}
+	}
+	if (ftqarc_finish(fd, &hdr, ent, nent) < 0 || close(fd) < 0) {
+		perror(archive_name);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "%d cells, %zu threads' files in %s\n", cell, nent,
+	        archive_name);
+	free(cstr);
+	exit(EXIT_SUCCESS);
+}
+
+/* the interrupt timeline, and, if we have the samples, who to blame */
+static void write_irqs(void)
+{
+	struct irqthread *it;
+	char fname[512];
+	int i;
+
+	irqtrace_stop();
+	snprintf(fname, sizeof(fname), "%s_irq.dat", outname);
+	if (irqtrace_write(fname, epoch, ticksperns) < 0)
+		exit(EXIT_FAILURE);
+	/* streaming, event and trigger threads keep no samples */
+	if (use_stream || event_pct || use_trigger)
+		return;
+	it = calloc(numthreads, sizeof(*it));
+	assert(it);
+	for (i = 0; i < numthreads; i++) {
+		/* unpinned threads could have been anywhere */
+		it[i].core = tinfo[i].core;
+		it[i].samples = tinfo[i].region.samples;
+		it[i].numsamples = numsamples;
+		it[i].max_count = tinfo[i].max_count;
+		it[i].elapsed = fwq_units != 0;
+	}
+	snprintf(fname, sizeof(fname), "%s_irqrank.txt", outname);
+	if (irqtrace_rank(fname, it, numthreads) < 0)
+		exit(EXIT_FAILURE);
+	free(it);
+}
+
 int main(int argc, char **argv)
 {
 	/* local variables */
-	static char fname[8192], outname[255];
-	int i, j;
+	int i;
 	int use_threads = 0;
-	FILE *fp;
-	int use_stdout = 0;
 	int rc;
 	pthread_t *threads;
-	ticks base;
-	size_t samples_size;
 
 	/* default output name prefix */
 	sprintf(outname, DEFAULT_OUTNAME);
@@ -155,10 +1750,33 @@ int main(int argc, char **argv)
 			{"ignore_wire_failures", 0, 0, 'w'},
 			{"realtime", 0, 0, 'r'},
 			{"delay", 0, 0, 'd'},
+			{"binary", 0, 0, 'b'},
+			{"psd", 0, 0, 'P'},
+			{"stream", 0, 0, 'S'},
+			{"housekeeping", 1, 0, 'H'},
+			{"ring", 1, 0, 'R'},
+			{"pmu", 1, 0, 'p'},
+			{"irq", 1, 0, 'i'},
+			{"events", 1, 0, 'e'},
+			{"context", 1, 0, 'C'},
+			{"kernel", 1, 0, 'k'},
+			{"timer", 1, 0, 'x'},
+			{"fwq", 1, 0, 'W'},
+			{"trigger", 1, 0, 'g'},
+			{"trigger-late", 1, 0, 'G'},
+			{"pre-post", 1, 0, 'B'},
+			{"decimate", 1, 0, 'D'},
+			{"overrun", 0, 0, 'O'},
+			{"telemetry", 1, 0, 'M'},
+			{"processes", 0, 0, 'F'},
+			{"cpus", 1, 0, 'c'},
+			{"archive", 1, 0, 'A'},
+			{"pack", 0, 0, 'z'},
+			{"mapped", 0, 0, 'm'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "n:hsf:o:t:T:wrd:", long_options,
+		c = getopt_long(argc, argv, "n:hsf:o:t:T:wrd:bPSH:R:p:i:e:C:k:x:W:g:G:B:D:OM:Fc:A:zm", long_options,
 						&option_index);
 		if (c == -1)
 			break;
@@ -166,6 +1784,7 @@ int main(int argc, char **argv)
 		switch (c) {
 			case 't':
 				numthreads = atoi(optarg);
+				thread_arg = optarg;
 				use_threads = 1;
 				break;
 			case 's':
@@ -178,6 +1797,7 @@ int main(int argc, char **argv)
 				/* the interval units are ns. */
 				interval = (unsigned long long)
 					(1e9 / atoi(optarg));
+				freq_arg = optarg;
 				break;
 			case 'n':
 				numsamples = atoi(optarg);
@@ -198,6 +1818,80 @@ int main(int argc, char **argv)
 					exit(-1);
 				}
 				break;
+			case 'b':
+				use_binary = 1;
+				break;
+			case 'z':
+				use_pack = 1;
+				break;
+			case 'm':
+				use_map = 1;
+				break;
+			case 'P':
+				use_psd = 1;
+				break;
+			case 'S':
+				use_stream = 1;
+				break;
+			case 'p':
+				pmu_events = optarg;
+				break;
+			case 'e':
+				event_pct = atoi(optarg);
+				break;
+			case 'C':
+				event_context = atoi(optarg);
+				break;
+			case 'k':
+				kernel_arg = optarg;
+				break;
+			case 'g':
+				trig_pct = atoi(optarg);
+				use_trigger = 1;
+				break;
+			case 'G':
+				trig_late_ns = strtoull(optarg, NULL, 0);
+				use_trigger = 1;
+				break;
+			case 'B':
+				if (sscanf(optarg, "%zu,%zu", &trig_pre, &trig_post) != 2) {
+					fprintf(stderr, "-B wants pre,post\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'O':
+				show_overrun = 1;
+				break;
+			case 'M':
+				tel_path = optarg;
+				break;
+			case 'F':
+				use_procs = 1;
+				break;
+			case 'c':
+				cpu_arg = optarg;
+				break;
+			case 'A':
+				archive_name = optarg;
+				break;
+			case 'D':
+				trig_decimate = strtoull(optarg, NULL, 0);
+				break;
+			case 'W':
+				fwq_units = strtoull(optarg, NULL, 0);
+				break;
+			case 'x':
+				timer_name = optarg;
+				break;
+			case 'i':
+				irq_msec = strtoul(optarg, NULL, 0);
+				break;
+			case 'H':
+				housekeeping_core = atoi(optarg);
+				break;
+			case 'R':
+				ringsize = strtoul(optarg, NULL, 0);
+				break;
 			case 'h':
 			default:
 				usage(argv[0]);
@@ -205,19 +1899,99 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* sanity check */
-	if (numsamples > MAX_SAMPLES) {
+	if (archive_name && (use_stream || pmu_events || event_pct || use_trigger
+	                     || fwq_units || use_procs || irq_msec || tel_path
+	                     || use_stdout || use_binary || use_psd)) {
+		fprintf(stderr, "ERROR: a sweep (-A) runs the kernel loops into "
+		        "its archive only.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_map && (archive_name || use_stream || event_pct || use_trigger
+	                || use_stdout || use_pack)) {
+		fprintf(stderr, "ERROR: -m keeps the samples of the kernel loops in "
+		        "their files, as they are; no -A, -S, -e, -g, -s or -z.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_map) {
+		use_binary = 1;
+		unfinished = 1;
+	}
+	if (use_pack && !use_binary && !archive_name) {
+		fprintf(stderr, "ERROR: -z packs binary files (-b) and archives "
+		        "(-A) only.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (kernel_arg && !archive_name) {
+		kernel = find_kernel(kernel_arg);
+		if (!kernel)
+			kernel_usage();
+	}
+	if (!archive_name && (cpu_arg || use_threads))
+		pick_cpus(use_threads);
+	if (cpu_arg)
+		use_threads = 1;
+
+	if (use_stream && pmu_events) {
+		fprintf(stderr, "ERROR: no hardware counters in streaming mode.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_stream && use_procs) {
+		fprintf(stderr, "ERROR: streaming mode runs threads only.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_stream && (use_binary || use_psd)) {
+		fprintf(stderr, "ERROR: streaming mode writes text only.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (kernel->supported && !kernel->supported()) {
+		fprintf(stderr, "ERROR: this cpu can not run the %s kernel.\n",
+		        kernel->name);
+		exit(EXIT_FAILURE);
+	}
+	if (kernel != &kernels[0]
+	    && (use_stream || pmu_events || event_pct || use_trigger)) {
+		fprintf(stderr, "ERROR: -S, -p, -e and -g use the %s kernel only.\n",
+		        kernels[0].name);
+		exit(EXIT_FAILURE);
+	}
+	if (fwq_units && (use_stream || pmu_events || event_pct)) {
+		fprintf(stderr, "ERROR: FWQ mode has no -S, -p or -e.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_trigger && (use_stream || pmu_events || event_pct || fwq_units
+	                    || use_binary || use_psd)) {
+		fprintf(stderr, "ERROR: trigger mode has no -S, -p, -e, -W, -b "
+		        "or -P.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_trigger && (trig_pct > 100 || !trig_decimate)) {
+		fprintf(stderr, "ERROR: bad trigger percent or decimation.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (event_pct > 100) {
+		fprintf(stderr, "ERROR: event threshold is a percent of the peak.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (event_context > EVENT_CONTEXT) {
+		fprintf(stderr, "ERROR: at most %d samples of event context.\n",
+		        EVENT_CONTEXT);
+		exit(EXIT_FAILURE);
+	}
+	if (event_pct && (use_stream || use_binary || use_psd || pmu_events)) {
+		fprintf(stderr, "ERROR: event mode keeps no samples; no -S, -b, "
+		        "-P or -p.\n");
+		exit(EXIT_FAILURE);
+	}
+	/*
+	 * sanity check; streaming and event mode have no limit, and -n 0
+	 * means forever
+	 */
+	if (!use_stream && !event_pct && !use_trigger
+	    && numsamples > MAX_SAMPLES) {
 		fprintf(stderr, "WARNING: sample count exceeds maximum.\n");
 		fprintf(stderr, "         setting count to maximum.\n");
 		numsamples = MAX_SAMPLES;
 	}
-	/* allocate sample storage */
-	samples_size = sizeof(struct sample) * numsamples * numthreads;
-	samples = allocate_samples(samples_size);
-	assert(samples);
-	/* in case mmap failed or MAP_POPULATE didn't populate */
-	memset(samples, 0, samples_size);
-
 	if (use_stdout == 1 && numthreads > 1) {
 		fprintf(stderr, "ERROR: cannot output to stdout for more than one thread.\n");
 		exit(EXIT_FAILURE);
@@ -225,12 +1999,56 @@ int main(int argc, char **argv)
 
 	if (ticksperns == 0.0)
 		ticksperns = compute_ticksperns();
+	pick_timer(use_stream || pmu_events || event_pct || use_trigger);
+	if (archive_name) {
+		static char freq[32];
+
+		if (!freq_arg) {
+			snprintf(freq, sizeof(freq), "%llu", 1000000000ULL / interval);
+			freq_arg = freq;
+		}
+		if (!thread_arg)
+			thread_arg = "1";
+		if (!kernel_arg)
+			kernel_arg = (char *)kernels[0].name;
+		run_sweep(argc, argv);
+	}
+	if (kernel->level)
+		kbuf_size = kernel_bufsize(kernel);
+
+	if (!use_threads)
+		pin_threads = 0;
+	if (use_procs) {
+		tinfo = shared_alloc(numthreads * sizeof(*tinfo));
+		start = shared_alloc(sizeof(*start));
+	} else {
+		tinfo = calloc(numthreads, sizeof(*tinfo));
+		assert(tinfo);
+	}
+	place_threads();
+	if (use_stream)
+		start_stream();
+	else
+		pthread_barrier_init(&done_barrier, NULL, numthreads);
+	if (event_pct || use_trigger) {
+		signal(SIGINT, stop_run);
+		signal(SIGTERM, stop_run);
+	}
+	if (tel_path)
+		start_telemetry();
+	if (irq_msec) {
+		pick_housekeeping("irq sampler");
+		if (irqtrace_start(irq_msec, housekeeping_core) < 0)
+			exit(EXIT_FAILURE);
+	}
 
 	/*
 	 * set up sampling.  first, take a few bogus samples to warm up the
 	 * cache and pipeline
 	 */
-	if (use_threads == 1) {
+	if (use_procs) {
+		run_processes();
+	} else if (use_threads == 1) {
 		if (threadinit(numthreads) < 0) {
 			fprintf(stderr, "threadinit failed\n");
 			assert(0);
@@ -251,68 +2069,28 @@ int main(int argc, char **argv)
 			}
 		}
 
-		hounds = 1;
 		/* TODO: abstract this nonsense into a call in
 		 * linux.c/akaros.c/etc */
 		for (i = 0; i < numthreads; i++) {
-			void *retval;
-
-			rc = pthread_join(threads[i], &retval);
+			rc = pthread_join(threads[i], NULL);
 			if (rc) {
 				fprintf(stderr,
 					"ERROR: pthread_join() failed.\n");
 				exit(EXIT_FAILURE);
 			}
-			total_count += (unsigned long)retval;
 		}
 	} else {
-		pin_threads = 0;
-		hounds = 1;
-		total_count = (unsigned long)ftq_thread(0);
-	}
-
-	fprintf(stderr, "Ticks per ns: %f\n", ticksperns);
-	fprintf(stderr, "Sample frequency is %f\n", 1e9 / interval);
-	fprintf(stderr, "Total count is %llu\n", total_count);
-	for (j = 0; j < numthreads; j++) {
-		for (i = 0; i < numsamples; i++) {
-			int ix = j * numsamples + i;
-			if (samples[ix].count > max_work) {
-				max_work = samples[ix].count;
-			}
-		}
+		ftq_thread(0);
 	}
-	max_work *= numthreads * numsamples;
-	fprintf(stderr, "Max possible work is %llu\n", max_work);
-	fprintf(stderr, "Fraction is %g\n", (1.0 * total_count) / max_work);
 
-	if (use_stdout == 1) {
-		header(stdout, 0);
-		base = samples[0].ticklast;
-		for (i = 0; i < numsamples; i++) {
-			fprintf(stdout, "%lld %lld\n",
-				(ticks)((samples[i].ticklast - base)
-					/ ticksperns), samples[i].count);
-		}
-	} else {
+	if (irq_msec)
+		write_irqs();
+	if (tel)
+		__atomic_store_n(&tel->done, 1, __ATOMIC_RELEASE);
 
-		for (j = 0; j < numthreads; j++) {
-			sprintf(fname, "%s_%d.dat", outname, j);
-			fp = fopen(fname, "w");
-			if (!fp) {
-				perror("can not create file");
-				exit(EXIT_FAILURE);
-			}
-			header(fp, j);
-			base = samples[numsamples * j].ticklast;
-			for (i = 0; i < numsamples; i++) {
-				int ix = j * numsamples + i;
-				fprintf(fp, "%lld %lld\n",
-					(ticks)((samples[ix].ticklast - base) / ticksperns),
-					samples[ix].count);
-			}
-			fclose(fp);
-		}
+	if (use_stream) {
+		finish_stream();
+		exit(EXIT_SUCCESS);
 	}
 
 	if (use_threads)
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 
 /*
  * use cycle timers from FFTW3 (http://www.fftw.org/).  this defines a
@@ -22,6 +23,17 @@
 #define MAX_BITS       30
 #define MIN_BITS       3
 #define DEFAULT_OUTNAME "ftq"
+/* the most cpus a -c list can name */
+#define CPU_LIST_MAX   4096
+/* cpu_isolation(): isolcpus=, nohz_full= */
+#define CORE_ISOLCPUS  1
+#define CORE_NOHZ_FULL 2
+/* from the last thread ready to the common start */
+#define START_MARGIN_MSEC 10
+/* per thread, in streaming mode; must be a power of 2 */
+#define DEFAULT_RING   65536
+/* -m: room for the comment header at the front of a mapped .bin file */
+#define LIVE_TEXT_ROOM 65536
 
 /**
  * Work grain, which is now fixed. 
@@ -35,9 +47,141 @@ struct sample {
 	unsigned long long count;
 };
 
-/* ftqcore.c */
-unsigned long main_loops(struct sample *samples, size_t numsamples,
-                         ticks tickinterval, int offset);
+/*
+ * -m: where the loops count the samples they have stored, in the header
+ * of the mapped file; NULL if it is not there. See FTQBIN_LIVE.
+ */
+extern __thread uint64_t *sample_progress;
+
+/* after sample done - 1, and whatever goes with it, is stored */
+static __inline__ void progress_sample(uint64_t *p, size_t done)
+{
+	if (p)
+		__atomic_store_n(p, done, __ATOMIC_RELEASE);
+}
+
+/*
+ * How a sample ended: when, and how far past its quantum's end. Sample i
+ * is quantum i; one that runs over a whole quantum is followed by empty
+ * samples that catch up.
+ */
+struct overrun {
+	ticks end;
+	ticks over;
+};
+
+/* a thread's sample storage, and where it ended up. */
+struct sample_region {
+	struct sample *samples;
+	size_t size;
+	size_t pagesize;
+	const char *kind;	/* "hugetlb", "base", ... */
+	int node;		/* -1 if unknown */
+};
+
+struct ring;
+struct pmu;
+struct irqsnap;
+struct event_log;
+struct trig;
+
+/*
+ * ftqcore.c
+ * Quantum k runs from start + k * tickinterval; start should be now, or
+ * a little in the future. ovr gets how each sample ended.
+ */
+unsigned long main_loops(struct sample *samples, struct overrun *ovr,
+                         size_t numsamples, ticks tickinterval, ticks start);
+/*
+ * Timers. The loops read the clock with one of these, inlined; readticks
+ * is the same clock for everyone else. ordered: work can not move across
+ * a read. ns: counts ns rather than cycles, so ticks per ns is 1. cost
+ * and jitter are measured by timer_measure, in ns.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define NTIMERS 4
+#else
+#define NTIMERS 2
+#endif
+
+struct timer {
+	const char *name;
+	const char *desc;
+	ticks (*read)(void);
+	int ordered;
+	int ns;
+	double cost, jitter;
+};
+extern struct timer timers[NTIMERS];
+/* the one in use, set before the threads start */
+extern const struct timer *timer;
+ticks readticks(void);
+void timer_measure(struct timer *t, double ticksperns);
+
+/* what a memory kernel works on, per thread */
+struct membuf {
+	char *buf;
+	size_t size;
+	size_t off;
+	void **chase;
+};
+
+/*
+ * Work kernels: each has its own loops for each timer, specialized for
+ * its work and the timer, so the choice costs nothing inside the loop.
+ * kernels[0] is the default; with timers[0] its loops is main_loops.
+ * supported is NULL if it runs anywhere. Memory kernels have the cache
+ * level their buffer is sized for (4 is DRAM), and init to fill it in;
+ * state is the struct membuf.
+ */
+struct kernel {
+	const char *name;
+	const char *desc;
+	/* [1] also updates telemetry and -m's progress after each sample */
+	unsigned long (*loops[2][NTIMERS])(struct sample *samples,
+	                                   struct overrun *ovr,
+	                                   size_t numsamples,
+	                                   ticks tickinterval, ticks start,
+	                                   void *state);
+	/* FWQ: units of work per sample; count is the ticks they took */
+	unsigned long (*fwq[2][NTIMERS])(struct sample *samples,
+	                                 size_t numsamples,
+	                                 unsigned long long units, ticks start,
+	                                 void *state);
+	int (*supported)(void);
+	int level;
+	void (*init)(struct membuf *m, unsigned int seed);
+};
+extern const struct kernel kernels[];
+const struct kernel *find_kernel(const char *name);
+size_t kernel_bufsize(const struct kernel *k);
+/* numsamples of 0 means run until *stop */
+unsigned long stream_loops(struct ring *ring, size_t numsamples,
+                           ticks tickinterval, ticks start,
+                           volatile int *stop);
+/* as main_loops, plus pmu->n counter deltas per sample in pmc */
+unsigned long pmu_loops(struct sample *samples, unsigned long long *pmc,
+                        size_t numsamples, ticks tickinterval, ticks start,
+                        struct pmu *pmu);
+double pmu_read_cost(struct pmu *pmu);
+/* only around the triggers, and summaries; 0 samples is until *stop */
+unsigned long trigger_loops(struct trig *t, size_t numsamples,
+                            ticks tickinterval, ticks start,
+                            volatile int *stop);
+/* only the dips, into log; numsamples of 0 means run until *stop */
+unsigned long event_loops(struct event_log *log, size_t numsamples,
+                          ticks tickinterval, ticks start,
+                          volatile int *stop);
+
+/* ftqout.c */
+char *format_sample(char *p, long long ns, long long count);
+int write_all(int fd, const void *buf, size_t len);
+int write_samples(int fd, const struct sample *s, size_t n, ticks base,
+                  double ticksperns);
+int write_samples_cols(int fd, const struct sample *s,
+                       const struct overrun *ovr,
+                       const unsigned long long *pmc, int npmc, size_t n,
+                       ticks base, double ticksperns);
 
 /* must be provided by OS code */
 /* Sorry, Plan 9; don't know how to manage FILE yet */
@@ -50,5 +194,22 @@ int wireme(int core);
 
 int get_num_cores(void);
 int get_coreid(void);
+/*
+ * the cpus in list ("2-7,12"), or all of them if it is NULL, that we may
+ * run on; the count, or -1 with a message
+ */
+int cpu_list(const char *list, int *cpus, int max);
+/* CORE_ flags for a cpu */
+int cpu_isolation(int cpu);
 void set_sched_realtime(void);
-struct sample *allocate_samples(size_t samples_size);
+/* call from the thread that will use them, after wireme() */
+int allocate_samples(struct sample_region *r, size_t samples_size);
+/* the same, but size bytes of the file name, mapped shared; for -m */
+int map_samples_file(struct sample_region *r, const char *name, size_t size);
+/* counters for this thread, by name, comma separated; see pmu.h */
+int pmu_open(struct pmu *pmu, const char *events);
+void pmu_close(struct pmu *pmu);
+/* bytes of data cache at level 1-3 on this core; 0 if unknown */
+size_t cache_size(int level);
+/* per-cpu interrupt counts, for irqtrace.c; see irqtrace.h */
+int irq_snapshot(struct irqsnap *snap);
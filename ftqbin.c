@@ -0,0 +1,454 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Binary sample files: writer, and an mmap-based reader that can turn
+ * them back into the text format ftq has always written. Also archives
+ * of them, for sweeps.
+ *
+ * Keep this file OS-independent, modulo mmap.
+ */
+#include "ftqbin.h"
+#include "ftqpack.h"
+#include "pmu.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* n overrun records, packed as samples */
+static void *pack_overruns(const struct overrun *ovr, size_t n, size_t *size)
+{
+	struct sample *s = malloc(n * sizeof(*s) + 1);
+	void *pack;
+	size_t i;
+
+	assert(s);
+	for (i = 0; i < n; i++) {
+		s[i].ticklast = ovr[i].end;
+		s[i].count = ovr[i].over;
+	}
+	pack = ftqpack_encode(s, n, size);
+	free(s);
+	return pack;
+}
+
+/* what every file starts with, whatever is in it */
+static void set_ident(struct ftqbin_header *hdr)
+{
+	memcpy(hdr->magic, FTQBIN_MAGIC, sizeof(hdr->magic));
+	hdr->version = FTQBIN_VERSION;
+	hdr->byteorder = FTQBIN_BYTEORDER;
+	hdr->hdrsize = sizeof(*hdr);
+	hdr->recsize = sizeof(struct sample);
+}
+
+/*
+ * Write a complete file. The caller fills in everything in hdr that
+ * describes the run, including npmc and flags; we fill in the layout
+ * fields, and pack the samples and ovr if flags has FTQBIN_PACKED. ovr
+ * may be NULL.
+ */
+int ftqbin_write(int fd, struct ftqbin_header *hdr, const char *text,
+                 size_t textsize, const struct sample *samples,
+                 const unsigned long long *pmc, const struct overrun *ovr)
+{
+	static const char zero[FTQBIN_ALIGN];
+	size_t off, datasize, ovrsize;
+	void *pack = NULL, *ovrpack = NULL;
+	int ret = -1;
+
+	set_ident(hdr);
+	hdr->flags &= ~FTQBIN_LIVE;
+	hdr->done = 0;
+	hdr->textsize = textsize;
+	off = sizeof(*hdr) + textsize;
+	hdr->dataoff = (off + FTQBIN_ALIGN - 1) & ~(uint64_t)(FTQBIN_ALIGN - 1);
+	datasize = hdr->numsamples * sizeof(struct sample);
+	ovrsize = hdr->numsamples * sizeof(*ovr);
+	hdr->packsize = hdr->ovrpacksize = 0;
+	if (hdr->flags & FTQBIN_PACKED) {
+		pack = ftqpack_encode(samples, hdr->numsamples, &hdr->packsize);
+		datasize = (hdr->packsize + 7) & ~7ULL;
+		if (ovr) {
+			ovrpack = pack_overruns(ovr, hdr->numsamples,
+			                        &hdr->ovrpacksize);
+			ovrsize = hdr->ovrpacksize;
+		}
+	}
+	hdr->pmcoff = hdr->npmc ? hdr->dataoff + datasize : 0;
+	hdr->ovroff = ovr ? hdr->dataoff + datasize + hdr->numsamples
+	                    * hdr->npmc * sizeof(*pmc) : 0;
+
+	if (write_all(fd, hdr, sizeof(*hdr)) < 0)
+		goto out;
+	if (write_all(fd, text, textsize) < 0)
+		goto out;
+	if (write_all(fd, zero, hdr->dataoff - off) < 0)
+		goto out;
+	if (pack) {
+		if (write_all(fd, pack, hdr->packsize) < 0
+		    || write_all(fd, zero, datasize - hdr->packsize) < 0)
+			goto out;
+	} else if (write_all(fd, samples, datasize) < 0)
+		goto out;
+	if (hdr->npmc && write_all(fd, pmc, hdr->numsamples * hdr->npmc
+	                           * sizeof(*pmc)) < 0)
+		goto out;
+	if (ovr && write_all(fd, ovrpack ? ovrpack : ovr, ovrsize) < 0)
+		goto out;
+	ret = 0;
+out:
+	free(pack);
+	free(ovrpack);
+	return ret;
+}
+
+/*
+ * A file for ftq to write in place, as it runs: hdr is filled in as for
+ * ftqbin_write, unpacked, and this adds the layout, with textroom bytes
+ * for the text and the records where ftqbin_write would put them. The
+ * caller maps a file of the size returned, and puts the header at its
+ * front, the text after it and the records at their offsets; as long as
+ * done counts the samples stored, the file can be read at any time.
+ */
+uint64_t ftqbin_live_layout(struct ftqbin_header *hdr, size_t textroom,
+                            int ovr)
+{
+	uint64_t off;
+
+	set_ident(hdr);
+	hdr->flags = (hdr->flags & ~FTQBIN_PACKED) | FTQBIN_LIVE;
+	hdr->textsize = hdr->done = 0;
+	hdr->packsize = hdr->ovrpacksize = 0;
+	off = sizeof(*hdr) + textroom;
+	hdr->dataoff = (off + FTQBIN_ALIGN - 1) & ~(uint64_t)(FTQBIN_ALIGN - 1);
+	off = hdr->dataoff + hdr->numsamples * sizeof(struct sample);
+	hdr->pmcoff = hdr->npmc ? off : 0;
+	off += hdr->numsamples * hdr->npmc * sizeof(unsigned long long);
+	hdr->ovroff = ovr ? off : 0;
+	if (ovr)
+		off += hdr->numsamples * sizeof(struct overrun);
+	return off;
+}
+
+/* the whole file, read-only; its length in *len */
+static void *map_file(const char *name, size_t min, size_t *len)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < min) {
+		fprintf(stderr, "%s: too short to be an ftq file\n", name);
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	map = mmap(0, *len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	return map;
+}
+
+/* n samples from the size bytes of pack at p, in malloc'd memory */
+static struct sample *unpack(const char *name, const void *p, size_t size,
+                             size_t n)
+{
+	const struct ftqpack_header *ph = p;
+	struct sample *s;
+
+	if (ftqpack_check(ph, size) < 0 || ph->numsamples != n) {
+		fprintf(stderr, "%s: bad packed samples\n", name);
+		return NULL;
+	}
+	s = malloc(n * sizeof(*s) + 1);
+	assert(s);
+	if (ftqpack_decode(ph, 0, n, s) < 0) {
+		fprintf(stderr, "%s: corrupt packed samples\n", name);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* a binary file at p; fb does not own the memory, but what it unpacks */
+static int ftqbin_parse(struct ftqbin *fb, const char *name, const void *p,
+                        size_t len)
+{
+	const struct ftqbin_header *hdr = p;
+	int packed, live;
+	uint64_t done;
+
+	memset(fb, 0, sizeof(*fb));
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, FTQBIN_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s: not an ftq binary file\n", name);
+		return -1;
+	}
+	if (hdr->byteorder != FTQBIN_BYTEORDER) {
+		fprintf(stderr, "%s: written with a different byte order\n", name);
+		return -1;
+	}
+	if (hdr->version > FTQBIN_VERSION) {
+		fprintf(stderr, "%s: version %u is newer than this reader (%u)\n",
+		        name, hdr->version, FTQBIN_VERSION);
+		return -1;
+	}
+	packed = hdr->flags & FTQBIN_PACKED;
+	live = hdr->flags & FTQBIN_LIVE;
+	if ((packed && live) || hdr->recsize < sizeof(struct sample)
+	    || hdr->hdrsize + hdr->textsize > hdr->dataoff
+	    || hdr->dataoff + (packed ? hdr->packsize
+	                       : hdr->numsamples * hdr->recsize) > len) {
+		fprintf(stderr, "%s: truncated or corrupt\n", name);
+		return -1;
+	}
+	if (hdr->recsize != sizeof(struct sample)) {
+		fprintf(stderr, "%s: record size %u, expected %zu\n",
+		        name, hdr->recsize, sizeof(struct sample));
+		return -1;
+	}
+
+	fb->hdr = hdr;
+	fb->text = (char *)p + hdr->hdrsize;
+	fb->samples = (struct sample *)((char *)p + hdr->dataoff);
+	fb->numsamples = hdr->numsamples;
+	if (live) {
+		/* the run may still be going; what done counts is there */
+		done = __atomic_load_n(&hdr->done, __ATOMIC_ACQUIRE);
+		if (done < fb->numsamples)
+			fb->numsamples = done;
+	}
+	if (hdr->npmc) {
+		if (hdr->npmc > PMU_MAX || hdr->pmcoff + hdr->numsamples
+		    * hdr->npmc * sizeof(*fb->pmc) > len) {
+			fprintf(stderr, "%s: bad counter columns\n", name);
+			return -1;
+		}
+		fb->pmc = (unsigned long long *)((char *)p + hdr->pmcoff);
+		fb->npmc = hdr->npmc;
+	}
+	if (hdr->ovroff) {
+		if (hdr->ovroff + (packed ? hdr->ovrpacksize : hdr->numsamples
+		                   * sizeof(*fb->ovr)) > len) {
+			fprintf(stderr, "%s: bad overrun records\n", name);
+			return -1;
+		}
+		fb->ovr = (struct overrun *)((char *)p + hdr->ovroff);
+		fb->ovrtext = hdr->flags & FTQBIN_OVRTEXT;
+	}
+	if (!packed)
+		return 0;
+
+	fb->unpacked = unpack(name, fb->samples, hdr->packsize,
+	                      hdr->numsamples);
+	if (!fb->unpacked)
+		return -1;
+	fb->samples = fb->unpacked;
+	if (fb->ovr) {
+		struct sample *s = unpack(name, fb->ovr, hdr->ovrpacksize,
+		                          hdr->numsamples);
+		size_t i;
+
+		if (!s) {
+			free(fb->unpacked);
+			fb->unpacked = NULL;
+			return -1;
+		}
+		fb->unpacked_ovr = malloc(hdr->numsamples
+		                          * sizeof(*fb->unpacked_ovr) + 1);
+		assert(fb->unpacked_ovr);
+		for (i = 0; i < hdr->numsamples; i++) {
+			fb->unpacked_ovr[i].end = s[i].ticklast;
+			fb->unpacked_ovr[i].over = s[i].count;
+		}
+		free(s);
+		fb->ovr = fb->unpacked_ovr;
+	}
+	return 0;
+}
+
+int ftqbin_open(struct ftqbin *fb, const char *name)
+{
+	size_t len;
+	void *map;
+
+	memset(fb, 0, sizeof(*fb));
+	map = map_file(name, sizeof(struct ftqbin_header), &len);
+	if (!map)
+		return -1;
+	if (ftqbin_parse(fb, name, map, len) < 0) {
+		munmap(map, len);
+		return -1;
+	}
+	fb->map = map;
+	fb->maplen = len;
+	madvise(fb->map, fb->maplen, MADV_SEQUENTIAL);
+	return 0;
+}
+
+void ftqbin_close(struct ftqbin *fb)
+{
+	free(fb->unpacked);
+	free(fb->unpacked_ovr);
+	if (fb->map)
+		munmap(fb->map, fb->maplen);
+	memset(fb, 0, sizeof(*fb));
+}
+
+/* Emit exactly what a text run of ftq would have written. */
+int ftqbin_write_text(struct ftqbin *fb, FILE *f)
+{
+	if (fwrite(fb->text, 1, fb->hdr->textsize, f) != fb->hdr->textsize)
+		return -1;
+	if (fb->numsamples < fb->hdr->numsamples
+	    && fprintf(f, "# unfinished: %zu of %llu samples\n", fb->numsamples,
+	               (unsigned long long)fb->hdr->numsamples) < 0)
+		return -1;
+	if (fflush(f))
+		return -1;
+	if (!fb->numsamples)
+		return 0;
+	return write_samples_cols(fileno(f), fb->samples,
+	                          fb->ovrtext ? fb->ovr : NULL, fb->pmc,
+	                          fb->npmc, fb->numsamples,
+	                          fb->samples[0].ticklast, fb->hdr->ticksperns);
+}
+
+/*
+ * Archives. The writer puts the header and the text at the front, then
+ * the caller writes binary files after ftqarc_align()s, and ftqarc_finish
+ * adds the index and fills in the header.
+ */
+int ftqarc_start(int fd, struct ftqarc_header *hdr, const char *meta,
+                 size_t metasize)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, FTQARC_MAGIC, sizeof(hdr->magic));
+	hdr->version = FTQARC_VERSION;
+	hdr->byteorder = FTQBIN_BYTEORDER;
+	hdr->hdrsize = sizeof(*hdr);
+	hdr->entsize = sizeof(struct ftqarc_entry);
+	hdr->metasize = metasize;
+	if (write_all(fd, hdr, sizeof(*hdr)) < 0)
+		return -1;
+	return write_all(fd, meta, metasize);
+}
+
+/* pad to where the next binary file goes, and return that offset */
+int64_t ftqarc_align(int fd)
+{
+	static const char zero[FTQBIN_ALIGN];
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	size_t pad;
+
+	if (off < 0)
+		return -1;
+	pad = (FTQBIN_ALIGN - off % FTQBIN_ALIGN) % FTQBIN_ALIGN;
+	if (write_all(fd, zero, pad) < 0)
+		return -1;
+	return off + pad;
+}
+
+int ftqarc_finish(int fd, struct ftqarc_header *hdr,
+                  const struct ftqarc_entry *ent, size_t n)
+{
+	off_t off = lseek(fd, 0, SEEK_CUR);
+
+	if (off < 0)
+		return -1;
+	hdr->indexoff = off;
+	hdr->nentries = n;
+	if (write_all(fd, ent, n * sizeof(*ent)) < 0)
+		return -1;
+	if (pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+		return -1;
+	return 0;
+}
+
+/* 1 if name starts like an archive */
+int ftqarc_is(const char *name)
+{
+	char magic[8];
+	int fd, is;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	is = read(fd, magic, sizeof(magic)) == sizeof(magic)
+	     && !memcmp(magic, FTQARC_MAGIC, sizeof(magic));
+	close(fd);
+	return is;
+}
+
+int ftqarc_open(struct ftqarc *fa, const char *name)
+{
+	const struct ftqarc_header *hdr;
+
+	memset(fa, 0, sizeof(*fa));
+	fa->map = map_file(name, sizeof(*hdr), &fa->maplen);
+	if (!fa->map)
+		return -1;
+	hdr = fa->map;
+	if (memcmp(hdr->magic, FTQARC_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s: not an ftq archive\n", name);
+		goto bad;
+	}
+	if (hdr->byteorder != FTQBIN_BYTEORDER) {
+		fprintf(stderr, "%s: written with a different byte order\n", name);
+		goto bad;
+	}
+	if (hdr->version > FTQARC_VERSION) {
+		fprintf(stderr, "%s: version %u is newer than this reader (%u)\n",
+		        name, hdr->version, FTQARC_VERSION);
+		goto bad;
+	}
+	if (hdr->entsize != sizeof(struct ftqarc_entry) || !hdr->indexoff
+	    || hdr->hdrsize + hdr->metasize > fa->maplen
+	    || hdr->indexoff + hdr->nentries * hdr->entsize > fa->maplen) {
+		fprintf(stderr, "%s: truncated, unfinished or corrupt\n", name);
+		goto bad;
+	}
+	fa->hdr = hdr;
+	fa->meta = (char *)fa->map + hdr->hdrsize;
+	fa->ent = (struct ftqarc_entry *)((char *)fa->map + hdr->indexoff);
+	fa->n = hdr->nentries;
+	return 0;
+bad:
+	ftqarc_close(fa);
+	return -1;
+}
+
+/* binary file i, in place; ftqbin_close it, in case it was packed */
+int ftqarc_member(struct ftqarc *fa, size_t i, struct ftqbin *fb)
+{
+	const struct ftqarc_entry *e = &fa->ent[i];
+	char name[64];
+
+	snprintf(name, sizeof(name), "archive entry %zu", i);
+	if (e->off + e->size > fa->maplen) {
+		fprintf(stderr, "%s: past the end of the archive\n", name);
+		return -1;
+	}
+	return ftqbin_parse(fb, name, (char *)fa->map + e->off, e->size);
+}
+
+void ftqarc_close(struct ftqarc *fa)
+{
+	if (fa->map)
+		munmap(fa->map, fa->maplen);
+	memset(fa, 0, sizeof(*fa));
+}
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Binary FTQ sample files.
+ *
+ * The layout is:
+ *	struct ftqbin_header
+ *	textsize bytes of the usual '#' comment header, as text
+ *	padding up to dataoff
+ *	numsamples records of recsize bytes each (struct sample), or,
+ *	with FTQBIN_PACKED, packsize bytes of them packed (see ftqpack.h),
+ *	padded to 8 bytes
+ *	numsamples * npmc counter deltas, 8 bytes each, at pmcoff
+ *	numsamples struct overrun, at ovroff, if it is not 0, or
+ *	ovrpacksize bytes of them packed
+ *
+ * A file with FTQBIN_LIVE was written in place as ftq ran (-m): it has
+ * the room for all numsamples, but only the first done of them are
+ * there if the run did not finish. Its text may be shorter than the
+ * room left for it before dataoff.
+ *
+ * Everything is in the byte order of the machine that wrote it; the
+ * byteorder field lets a reader notice when that is not its own.
+ * Readers must use hdrsize, recsize and dataoff rather than sizeof, so
+ * that newer versions can grow the header and the records.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ftq.h"
+
+#define FTQBIN_MAGIC     "FTQBIN\n"
+#define FTQBIN_VERSION   1
+#define FTQBIN_BYTEORDER 0x01020304
+/* records start on this boundary, so a mapped file can be used in place */
+#define FTQBIN_ALIGN     4096
+/*
+ * flags: the text had the overrun columns; the samples are packed; the
+ * file was written as the run went
+ */
+#define FTQBIN_OVRTEXT   1
+#define FTQBIN_PACKED    2
+#define FTQBIN_LIVE      4
+
+struct ftqbin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t hdrsize;
+	uint32_t recsize;
+	int32_t thread;
+	int32_t core;
+	uint64_t textsize;
+	uint64_t dataoff;
+	uint64_t numsamples;
+	/* the sample interval, in ns */
+	uint64_t interval;
+	double frequency;
+	double ticksperns;
+	uint64_t total_count;
+	uint64_t max_work;
+	/* where the samples were allocated */
+	int32_t node;
+	uint32_t pad;
+	uint64_t pagesize;
+	uint32_t npmc;
+	uint32_t pad2;
+	uint64_t pmcoff;
+	uint64_t ovroff;
+	uint32_t flags;
+	uint32_t pad3;
+	uint64_t packsize;
+	uint64_t ovrpacksize;
+	/* with FTQBIN_LIVE, the samples stored so far */
+	uint64_t done;
+};
+
+/*
+ * Archives: many binary files, and what they were, in one file.
+ *	struct ftqarc_header
+ *	metasize bytes of text describing the whole run
+ *	the binary files, each starting on an FTQBIN_ALIGN boundary
+ *	nentries struct ftqarc_entry at indexoff, one per binary file
+ */
+#define FTQARC_MAGIC     "FTQARC\n"
+#define FTQARC_VERSION   1
+
+struct ftqarc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t hdrsize;
+	uint32_t entsize;
+	uint64_t metasize;
+	uint64_t indexoff;
+	uint64_t nentries;
+};
+
+struct ftqarc_entry {
+	uint64_t off;
+	uint64_t size;
+	/* the sweep cell it came from, and that cell's parameters */
+	uint32_t cell;
+	int32_t threads;
+	int32_t thread;
+	int32_t core;
+	uint64_t interval;
+	char kernel[16];
+	char cpus[64];
+};
+
+/* a mapped binary file. */
+struct ftqbin {
+	void *map;
+	size_t maplen;
+	const struct ftqbin_header *hdr;
+	const char *text;
+	const struct sample *samples;
+	/* of hdr->numsamples; fewer, if a live file's run was cut short */
+	size_t numsamples;
+	/* the samples and overruns, if they were packed; ftqbin_close frees them */
+	struct sample *unpacked;
+	struct overrun *unpacked_ovr;
+	/* hardware counter columns, if any; see pmu.h */
+	const unsigned long long *pmc;
+	int npmc;
+	/* how each sample ended, if the file has it */
+	const struct overrun *ovr;
+	int ovrtext;
+};
+
+/* ftqbin.c */
+int ftqbin_write(int fd, struct ftqbin_header *hdr, const char *text,
+                 size_t textsize, const struct sample *samples,
+                 const unsigned long long *pmc, const struct overrun *ovr);
+uint64_t ftqbin_live_layout(struct ftqbin_header *hdr, size_t textroom,
+                            int ovr);
+int ftqbin_open(struct ftqbin *fb, const char *name);
+void ftqbin_close(struct ftqbin *fb);
+int ftqbin_write_text(struct ftqbin *fb, FILE *f);
+
+/* a mapped archive */
+struct ftqarc {
+	void *map;
+	size_t maplen;
+	const struct ftqarc_header *hdr;
+	const char *meta;
+	const struct ftqarc_entry *ent;
+	size_t n;
+};
+
+int ftqarc_start(int fd, struct ftqarc_header *hdr, const char *meta,
+                 size_t metasize);
+int64_t ftqarc_align(int fd);
+int ftqarc_finish(int fd, struct ftqarc_header *hdr,
+                  const struct ftqarc_entry *ent, size_t n);
+int ftqarc_is(const char *name);
+int ftqarc_open(struct ftqarc *fa, const char *name);
+int ftqarc_member(struct ftqarc *fa, size_t i, struct ftqbin *fb);
+void ftqarc_close(struct ftqarc *fa);
@@ -0,0 +1,559 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * ftqcmp.c : did the noise get worse? Compare two sets of runs.
+ *
+ * ftqcmp [options] base files... -- new files...
+ *
+ * Each file's samples become lost work, as a fraction of that file's
+ * best sample: 1 - count / peak for FTQ, 1 - least / ticks for FWQ. The
+ * two pools are compared by percentiles, the rate of dips (samples
+ * below -d percent of the peak), the two-sample Kolmogorov-Smirnov and
+ * Anderson-Darling tests, and bootstrapped confidence intervals for the
+ * differences.
+ *
+ * The exit status is 1 if a -q, -r, -k or -A threshold is exceeded, that
+ * is, the difference is past the limit and its interval excludes zero
+ * (or, for -k and -A, the KS or AD test is significant); 2 on errors.
+ *
+ * The bootstrap treats samples as independent. Noise comes in bursts,
+ * so the intervals are on the optimistic side.
+ */
+#include "ftqbin.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAXQ 16
+
+struct pool {
+	double *v;
+	size_t n, max;
+	/* samples below the dip threshold */
+	size_t dips;
+};
+
+static const double default_q[] = { 50, 90, 99, 99.9, 99.99, 100 };
+
+static double dip_pct = 90;
+static double alpha = 0.05;
+static int nboot = 1000;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static void usage(char *av0)
+{
+	fprintf(stderr, "usage: %s [-d dip-percent] [-a alpha] [-b bootstraps] "
+	        "[-s seed] [-q pct=limit]... [-r dips-per-1k-limit] "
+	        "[-k ks-d-limit] [-A ad-t-limit] base.dat|bin... -- "
+	        "new.dat|bin...\n", av0);
+	exit(2);
+}
+
+static void add(struct pool *p, double v)
+{
+	if (p->n == p->max) {
+		p->max = p->max ? 2 * p->max : 1 << 20;
+		p->v = realloc(p->v, p->max * sizeof(*p->v));
+		assert(p->v);
+	}
+	p->v[p->n++] = v;
+}
+
+/* lost work for counts c[0..n-1]; for FWQ they are ticks, lower is better */
+static void add_counts(struct pool *p, const unsigned long long *c,
+                       size_t stride, size_t n, int fwq)
+{
+	unsigned long long best = c[0];
+	size_t i;
+	double lost;
+
+	for (i = 0; i < n; i++)
+		if (fwq ? c[i * stride] < best : c[i * stride] > best)
+			best = c[i * stride];
+	if (!best)
+		return;
+	for (i = 0; i < n; i++) {
+		if (fwq)
+			lost = c[i * stride] ? 1 - (double)best / c[i * stride] : 0;
+		else
+			lost = 1 - (double)c[i * stride] / best;
+		add(p, lost);
+		if (lost > 1 - dip_pct / 100)
+			p->dips++;
+	}
+}
+
+static int load_bin(struct pool *p, const char *name)
+{
+	struct ftqbin fb;
+	size_t i;
+	int fwq = 0;
+
+	if (ftqbin_open(&fb, name) < 0)
+		return -1;
+	for (i = 0; i + 6 <= fb.hdr->textsize; i++)
+		if ((!i || fb.text[i - 1] == '\n')
+		    && !memcmp(fb.text + i, "# fwq:", 6))
+			fwq = 1;
+	if (fb.numsamples)
+		add_counts(p, &fb.samples[0].count,
+		           sizeof(struct sample) / sizeof(unsigned long long),
+		           fb.numsamples, fwq);
+	ftqbin_close(&fb);
+	return 0;
+}
+
+/* the second number on each line that is not a comment */
+static int load_dat(struct pool *p, const char *name)
+{
+	unsigned long long *c = NULL, v;
+	size_t n = 0, max = 0;
+	const char *s, *end;
+	struct stat st;
+	char *map;
+	int fd, fwq = 0;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %m\n", name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %m\n", name);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	for (s = map, end = map + st.st_size; s < end; s++) {
+		if (*s == '#') {
+			if (end - s > 6 && !memcmp(s, "# fwq:", 6))
+				fwq = 1;
+			goto next;
+		}
+		/* skip the time, then read the count */
+		while (s < end && (*s == '-' || (*s >= '0' && *s <= '9')))
+			s++;
+		while (s < end && *s == ' ')
+			s++;
+		if (s == end || *s < '0' || *s > '9')
+			goto next;
+		for (v = 0; s < end && *s >= '0' && *s <= '9'; s++)
+			v = v * 10 + *s - '0';
+		if (n == max) {
+			max = max ? 2 * max : 1 << 20;
+			c = realloc(c, max * sizeof(*c));
+			assert(c);
+		}
+		c[n++] = v;
+next:
+		while (s < end && *s != '\n')
+			s++;
+	}
+	munmap(map, st.st_size);
+	if (n)
+		add_counts(p, c, 1, n, fwq);
+	free(c);
+	return 0;
+}
+
+static int load(struct pool *p, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 4 && !strcmp(name + len - 4, ".bin"))
+		return load_bin(p, name);
+	return load_dat(p, name);
+}
+
+/* lost work is in [0, 1), so its bits sort as integers; 16 at a time */
+static void sort(struct pool *p)
+{
+	uint64_t *a = (uint64_t *)p->v, *b, *t;
+	size_t i, *count, sum, c;
+	int shift;
+
+	b = malloc(p->n * sizeof(*b));
+	count = malloc(65536 * sizeof(*count));
+	assert(b && count);
+	for (shift = 0; shift < 64; shift += 16) {
+		memset(count, 0, 65536 * sizeof(*count));
+		for (i = 0; i < p->n; i++)
+			count[(a[i] >> shift) & 0xffff]++;
+		/* all the same digit: nothing to do */
+		if (p->n && count[(a[0] >> shift) & 0xffff] == p->n)
+			continue;
+		for (sum = 0, i = 0; i < 65536; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < p->n; i++)
+			b[count[(a[i] >> shift) & 0xffff]++] = a[i];
+		t = a;
+		a = b;
+		b = t;
+	}
+	if (a != (uint64_t *)p->v) {
+		memcpy(p->v, a, p->n * sizeof(*a));
+		b = a;
+	}
+	free(b);
+	free(count);
+}
+
+/* nearest rank: the k-th smallest, 1-based */
+static size_t rank(size_t n, double q)
+{
+	size_t k = ceil(q / 100 * n);
+
+	return k < 1 ? 1 : k > n ? n : k;
+}
+
+static double uniform(void)
+{
+	/* xorshift64* */
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+static double normal(void)
+{
+	double u = uniform();
+
+	while (u == 0)
+		u = uniform();
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * uniform());
+}
+
+/* Marsaglia and Tsang; a >= 1 */
+static double gamma_rand(double a)
+{
+	double d = a - 1.0 / 3, c = 1 / sqrt(9 * d), x, v, u;
+
+	for (;;) {
+		x = normal();
+		v = 1 + c * x;
+		if (v <= 0)
+			continue;
+		v = v * v * v;
+		u = uniform();
+		if (log(u) < 0.5 * x * x + d - d * v + d * log(v))
+			return d * v;
+	}
+}
+
+/*
+ * The k-th smallest of a bootstrap resample of the sorted pool, without
+ * drawing the resample: it is pool[n * U], U the k-th smallest of n
+ * uniforms, which is Beta(k, n + 1 - k).
+ */
+static double boot_rank(const struct pool *p, size_t k)
+{
+	double x = gamma_rand(k), y = gamma_rand(p->n + 1 - k);
+	size_t i = p->n * (x / (x + y));
+
+	return p->v[i < p->n ? i : p->n - 1];
+}
+
+static double poisson(double mean)
+{
+	double l = exp(-mean), t = uniform();
+	size_t k = 0;
+
+	while (t > l) {
+		t *= uniform();
+		k++;
+	}
+	return k;
+}
+
+/* dips in a bootstrap resample: Binomial(n, dips / n) */
+static double boot_dips(const struct pool *p)
+{
+	double n = p->n, q = p->dips / n, sd = sqrt(n * q * (1 - q)), k;
+
+	if (sd >= 5) {
+		k = round(n * q + sd * normal());
+		return k < 0 ? 0 : k > n ? n : k;
+	}
+	if (q <= 0.5)
+		return poisson(n * q);
+	return n - poisson(n * (1 - q));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the 1 - alpha interval of the replicates */
+static void interval(double *r, double *lo, double *hi)
+{
+	qsort(r, nboot, sizeof(*r), cmp_double);
+	*lo = r[(size_t)(alpha / 2 * (nboot - 1))];
+	*hi = r[(size_t)((1 - alpha / 2) * (nboot - 1))];
+}
+
+/* Kolmogorov-Smirnov: D, and the asymptotic p */
+static double ks(const struct pool *a, const struct pool *b, double *p)
+{
+	double d = 0, f, ne, lambda, sum = 0, term;
+	size_t i = 0, j = 0;
+	double x;
+	int k;
+
+	while (i < a->n && j < b->n) {
+		x = a->v[i] < b->v[j] ? a->v[i] : b->v[j];
+		while (i < a->n && a->v[i] == x)
+			i++;
+		while (j < b->n && b->v[j] == x)
+			j++;
+		f = fabs((double)i / a->n - (double)j / b->n);
+		if (f > d)
+			d = f;
+	}
+	ne = (double)a->n * b->n / (a->n + b->n);
+	lambda = (sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * d;
+	for (k = 1; k <= 100; k++) {
+		term = 2 * (k & 1 ? 1 : -1) * exp(-2.0 * k * k * lambda * lambda);
+		sum += term;
+		if (fabs(term) < 1e-12)
+			break;
+	}
+	*p = lambda < 0.2 ? 1 : sum < 0 ? 0 : sum > 1 ? 1 : sum;
+	return d;
+}
+
+/*
+ * Anderson-Darling, two samples, allowing for ties (Scholz and Stephens
+ * 1987, A2akN), standardized. *p is interpolated in their table of
+ * critical values, so it is only known between 0.001 and 0.25.
+ */
+static double ad(const struct pool *a, const struct pool *b, double *p)
+{
+	static const double sig[] = { 0.25, 0.1, 0.05, 0.025, 0.01, 0.005,
+	                              0.001 };
+	static const double b0[] = { 0.675, 1.281, 1.645, 1.96, 2.326, 2.573,
+	                             3.085 };
+	static const double b1[] = { -0.245, 0.25, 0.678, 1.149, 1.822, 2.364,
+	                             3.615 };
+	static const double b2[] = { -0.105, -0.305, -0.362, -0.391, -0.396,
+	                             -0.345, -0.154 };
+	const struct pool *s[2] = { a, b };
+	double N = a->n + b->n, A2 = 0, H, h = 0, g = 0, hi, x, l, B = 0, Ba;
+	double M, crit[7], ca, cb, cc, cd, var, T;
+	size_t idx[2] = { 0, 0 }, lt[2] = { 0, 0 }, eq[2], j, n = a->n + b->n;
+	int i, k;
+
+	while (idx[0] < a->n || idx[1] < b->n) {
+		if (idx[0] == a->n)
+			x = b->v[idx[1]];
+		else if (idx[1] == b->n)
+			x = a->v[idx[0]];
+		else
+			x = a->v[idx[0]] < b->v[idx[1]] ? a->v[idx[0]]
+			                                : b->v[idx[1]];
+		for (i = 0; i < 2; i++) {
+			lt[i] = idx[i];
+			while (idx[i] < s[i]->n && s[i]->v[idx[i]] == x)
+				idx[i]++;
+			eq[i] = idx[i] - lt[i];
+		}
+		l = eq[0] + eq[1];
+		B += l;
+		Ba = B - l / 2;
+		if (Ba * (N - Ba) - N * l / 4 <= 0)
+			continue;
+		for (i = 0; i < 2; i++) {
+			M = lt[i] + eq[i] / 2.0;
+			A2 += l / s[i]->n * (N * M - s[i]->n * Ba)
+			      * (N * M - s[i]->n * Ba)
+			      / (Ba * (N - Ba) - N * l / 4);
+		}
+	}
+	A2 *= (N - 1) / (N * N);
+
+	/* its variance; g = sum over i < j < N of 1 / ((N - i) j) */
+	H = 1.0 / a->n + 1.0 / b->n;
+	for (j = 1; j < n; j++)
+		h += 1.0 / j;
+	for (hi = 0, j = 1; j + 2 <= n; j++) {
+		hi += 1.0 / j;
+		g += (h - hi) / (N - j);
+	}
+	k = 2;
+	ca = (4 * g - 6) * (k - 1) + (10 - 6 * g) * H;
+	cb = (2 * g - 4) * k * k + 8 * h * k + (2 * g - 14 * h - 4) * H
+	     - 8 * h + 4 * g - 6;
+	cc = (6 * h + 2 * g - 2) * k * k + (4 * h - 4 * g + 6) * k
+	     + (2 * h - 6) * H + 4 * h;
+	cd = (2 * h + 6) * k * k - 4 * h * k;
+	var = (((ca * N + cb) * N + cc) * N + cd) / ((N - 1) * (N - 2) * (N - 3));
+	T = (A2 - (k - 1)) / sqrt(var);
+
+	/* m = k - 1 = 1 */
+	for (i = 0; i < 7; i++)
+		crit[i] = b0[i] + b1[i] + b2[i];
+	*p = sig[6];
+	if (T <= crit[0])
+		*p = sig[0];
+	else
+		for (i = 0; i < 6; i++)
+			if (T < crit[i + 1]) {
+				*p = exp(log(sig[i]) + (T - crit[i])
+				         / (crit[i + 1] - crit[i])
+				         * (log(sig[i + 1]) - log(sig[i])));
+				break;
+			}
+	return T;
+}
+
+int main(int argc, char **argv)
+{
+	struct pool pool[2] = { { 0 } };
+	double q[MAXQ], qlimit[MAXQ], dlimit = -1, klimit = -1;
+	/* T can be below 0, so no limit is NAN */
+	double alimit = NAN;
+	double *r, va, vb, lo, hi, d, pks, T, pad, ra, rb;
+	double pct, limit;
+	int nq, c, i, j, set = 0, fail = 0, ret;
+	size_t ka, kb;
+
+	memcpy(q, default_q, sizeof(default_q));
+	nq = sizeof(default_q) / sizeof(default_q[0]);
+	for (i = 0; i < MAXQ; i++)
+		qlimit[i] = -1;
+	while ((c = getopt(argc, argv, "+d:a:b:s:q:r:k:A:h")) != -1) {
+		switch (c) {
+			case 'd':
+				dip_pct = strtod(optarg, NULL);
+				break;
+			case 'a':
+				alpha = strtod(optarg, NULL);
+				break;
+			case 'b':
+				nboot = atoi(optarg);
+				break;
+			case 's':
+				rng = strtoull(optarg, NULL, 0) | 1;
+				break;
+			case 'q':
+				if (sscanf(optarg, "%lf=%lf", &pct, &limit) != 2
+				    || pct <= 0 || pct > 100 || limit < 0)
+					usage(argv[0]);
+				/* a default percentile, or a new row */
+				for (i = 0; i < nq && q[i] != pct; i++)
+					;
+				if (i == MAXQ)
+					usage(argv[0]);
+				if (i == nq)
+					nq++;
+				q[i] = pct;
+				qlimit[i] = limit;
+				break;
+			case 'r':
+				dlimit = strtod(optarg, NULL);
+				break;
+			case 'k':
+				klimit = strtod(optarg, NULL);
+				break;
+			case 'A':
+				alimit = strtod(optarg, NULL);
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (nboot < 10 || alpha <= 0 || alpha >= 1)
+		usage(argv[0]);
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			set++;
+			continue;
+		}
+		if (set > 1)
+			usage(argv[0]);
+		if (load(&pool[set], argv[i]) < 0)
+			exit(2);
+	}
+	if (set != 1)
+		usage(argv[0]);
+	for (i = 0; i < 2; i++) {
+		if (!pool[i].n) {
+			fprintf(stderr, "no samples in the %s files\n",
+			        i ? "new" : "base");
+			exit(2);
+		}
+		sort(&pool[i]);
+	}
+
+	r = malloc(nboot * sizeof(*r));
+	assert(r);
+	printf("%-16s %14s %14s %14s   %.4g%% interval\n", "lost work",
+	       "base", "new", "delta", 100 * (1 - alpha));
+	printf("%-16s %14zu %14zu\n", "samples", pool[0].n, pool[1].n);
+	for (i = 0; i < nq; i++) {
+		ka = rank(pool[0].n, q[i]);
+		kb = rank(pool[1].n, q[i]);
+		va = pool[0].v[ka - 1];
+		vb = pool[1].v[kb - 1];
+		for (j = 0; j < nboot; j++)
+			r[j] = boot_rank(&pool[1], kb) - boot_rank(&pool[0], ka);
+		interval(r, &lo, &hi);
+		printf("p%-15g %14.6f %14.6f %+14.6f   [%+.6f, %+.6f]\n", q[i],
+		       va, vb, vb - va, lo, hi);
+		if (qlimit[i] >= 0 && vb - va > qlimit[i] && lo > 0) {
+			printf("FAIL: p%g rose by %g, limit %g\n", q[i], vb - va,
+			       qlimit[i]);
+			fail = 1;
+		}
+	}
+	ra = 1000.0 * pool[0].dips / pool[0].n;
+	rb = 1000.0 * pool[1].dips / pool[1].n;
+	for (j = 0; j < nboot; j++)
+		r[j] = 1000 * (boot_dips(&pool[1]) / pool[1].n
+		               - boot_dips(&pool[0]) / pool[0].n);
+	interval(r, &lo, &hi);
+	printf("dips/1k (<%g%%)  %14.4f %14.4f %+14.4f   [%+.4f, %+.4f]\n",
+	       dip_pct, ra, rb, rb - ra, lo, hi);
+	if (dlimit >= 0 && rb - ra > dlimit && lo > 0) {
+		printf("FAIL: dips rose by %g per 1000 samples, limit %g\n",
+		       rb - ra, dlimit);
+		fail = 1;
+	}
+
+	d = ks(&pool[0], &pool[1], &pks);
+	printf("Kolmogorov-Smirnov D %.6f, p %.3g\n", d, pks);
+	if (klimit >= 0 && d > klimit && pks < alpha) {
+		printf("FAIL: KS D %g, limit %g\n", d, klimit);
+		fail = 1;
+	}
+	T = ad(&pool[0], &pool[1], &pad);
+	printf("Anderson-Darling T %.4f, p %s%.3g\n", T,
+	       pad <= 0.001 ? "<= " : pad >= 0.25 ? ">= " : "", pad);
+	if (!isnan(alimit) && T > alimit && pad < alpha) {
+		printf("FAIL: AD T %g, limit %g\n", T, alimit);
+		fail = 1;
+	}
+
+	ret = fail;
+	free(r);
+	free(pool[0].v);
+	free(pool[1].v);
+	return ret;
+}
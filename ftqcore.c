@@ -18,22 +18,736 @@
  * Keep this file OS-independent.
  */
 #include "ftq.h"
+#include "ftqring.h"
+#include "ftqevent.h"
+#include "ftqtrig.h"
+#include "ftqtel.h"
+#include "ftqhist.h"
+#include "pmu.h"
+
+#include <time.h>
 
 /*************************************************************************
  * All time base here is in ticks; computation to ns is done elsewhere   *
  * as needed.                                                            *
  *************************************************************************/
 
-unsigned long main_loops(struct sample *samples, size_t numsamples,
-                         ticks tickinterval, int offset)
+__thread struct tel_thread *telemetry;
+__thread struct thread_hist *histograms;
+__thread uint64_t *sample_progress;
+
+/*
+ * The timers. Each kernel gets a copy of its loop for each of these,
+ * with the timer inlined; see struct timer in ftq.h. "ticks" is
+ * whatever cycle.h does, which on x86-64 is lfence; rdtsc.
+ */
+#define KERNEL_INLINE static __inline__ __attribute__((always_inline))
+
+KERNEL_INLINE ticks ticks_timer(void)
+{
+	return getticks();
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+
+KERNEL_INLINE ticks rdtsc_timer(void)
+{
+	unsigned a, d;
+
+	asm volatile ("rdtsc":"=a" (a), "=d"(d));
+	return ((ticks) a) | (((ticks) d) << 32);
+}
+
+/*
+ * rdtscp waits for what came before, but not for what comes after; the
+ * lfence keeps the next sample's work from starting ahead of it.
+ */
+KERNEL_INLINE ticks rdtscp_timer(void)
+{
+	unsigned a, d, c;
+
+	asm volatile ("rdtscp; lfence":"=a" (a), "=d"(d), "=c"(c));
+	return ((ticks) a) | (((ticks) d) << 32);
+}
+
+#define FOR_TIMERS(X, ...) \
+	X(ticks, __VA_ARGS__) X(rdtsc, __VA_ARGS__) \
+	X(rdtscp, __VA_ARGS__) X(clock, __VA_ARGS__)
+#else
+#define FOR_TIMERS(X, ...) X(ticks, __VA_ARGS__) X(clock, __VA_ARGS__)
+#endif
+
+/* vDSO on Linux, so no system call; counts ns */
+KERNEL_INLINE ticks clock_timer(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define TIMER_READ(timer, unused) \
+	static ticks timer##_read(void) \
+	{ \
+		return timer##_timer(); \
+	}
+FOR_TIMERS(TIMER_READ, )
+
+struct timer timers[NTIMERS] = {
+	{"ticks", "cycle.h getticks", ticks_read, 1, 0},
+#if defined(__GNUC__) && defined(__x86_64__)
+	{"rdtsc", "rdtsc, unfenced", rdtsc_read, 0, 0},
+	{"rdtscp", "rdtscp; lfence", rdtscp_read, 1, 0},
+#endif
+	{"clock", "clock_gettime(CLOCK_MONOTONIC)", clock_read, 1, 1},
+};
+const struct timer *timer = &timers[0];
+
+ticks readticks(void)
+{
+	return timer->read();
+}
+
+static int by_ticks(const void *a, const void *b)
+{
+	const ticks *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/*
+ * Back to back reads: the cost is the mean time per read, the jitter
+ * the 99th percentile of the time between two reads, both in ns.
+ */
+void timer_measure(struct timer *t, double ticksperns)
+{
+	enum { N = 100000 };
+	static ticks d[N];
+	double scale = t->ns ? 1.0 : 1.0 / ticksperns;
+	ticks first, last;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		t->read();
+	first = last = t->read();
+	for (i = 0; i < N; i++) {
+		ticks now = t->read();
+
+		d[i] = now - last;
+		last = now;
+	}
+	t->cost = (last - first) * scale / N;
+	qsort(d, N, sizeof(*d), by_ticks);
+	t->jitter = d[N * 99 / 100] * scale;
+}
+
+/*
+ * The work kernels. Each is one unit of work, which leaves *count one
+ * higher (memory kernels: the number of lines touched). kernel_loops is
+ * inlined into a loops function per kernel per timer, with the work and
+ * the timer inlined too, so each inner loop is as specialized as the
+ * one main_loops always had. "int" with "ticks" is that original loop.
+ */
+KERNEL_INLINE void int_work(volatile unsigned long long *count, const int grain)
+{
+	int k;
+
+	for (k = 0; k < grain; k++)
+		(*count)++;
+	for (k = 0; k < (grain - 1); k++)
+		(*count)--;
+}
+
+KERNEL_INLINE void int8_work(volatile unsigned long long *count, void *state)
+{
+	int_work(count, 8);
+}
+
+KERNEL_INLINE void int16_work(volatile unsigned long long *count, void *state)
+{
+	int_work(count, 16);
+}
+
+KERNEL_INLINE void int32_work(volatile unsigned long long *count, void *state)
+{
+	int_work(count, ITERCOUNT);
+}
+
+KERNEL_INLINE void int64_work(volatile unsigned long long *count, void *state)
+{
+	int_work(count, 64);
+}
+
+KERNEL_INLINE void float_work(volatile unsigned long long *count, void *state)
+{
+	volatile double f = 0.0;
+	int k;
+
+	for (k = 0; k < ITERCOUNT; k++)
+		f++;
+	for (k = 0; k < (ITERCOUNT - 1); k++)
+		f--;
+	(*count)++;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+ * A dependent chain of ITERCOUNT vector adds. The empty asm makes the
+ * compiler keep each add, in a register, rather than fold them.
+ */
+__attribute__((target("avx2")))
+KERNEL_INLINE void avx2_work(volatile unsigned long long *count, void *state)
+{
+	__m256d v = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+	int k;
+
+	for (k = 0; k < ITERCOUNT; k++) {
+		v = _mm256_add_pd(v, one);
+		__asm__ volatile("" : "+x"(v));
+	}
+	(*count)++;
+}
+
+__attribute__((target("avx512f")))
+KERNEL_INLINE void avx512_work(volatile unsigned long long *count, void *state)
+{
+	__m512d v = _mm512_setzero_pd(), one = _mm512_set1_pd(1.0);
+	int k;
+
+	for (k = 0; k < ITERCOUNT; k++) {
+		v = _mm512_add_pd(v, one);
+		__asm__ volatile("" : "+v"(v));
+	}
+	(*count)++;
+}
+
+static int have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int have_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/*
+ * Memory kernels, on a per-thread buffer sized for one level of the
+ * hierarchy. stream reads one word from each line in order, which the
+ * prefetchers love, so it measures bandwidth; chase follows pointers
+ * through the lines in a random cycle, one miss at a time, so it
+ * measures latency. Either way a unit of work is MEM_UNIT lines.
+ */
+#define MEM_LINE 64
+#define MEM_UNIT 16
+
+KERNEL_INLINE void stream_work(volatile unsigned long long *count,
+                               void *state)
+{
+	struct membuf *m = state;
+	const char *p = m->buf + m->off;
+	unsigned long sum = 0;
+	int k;
+
+	for (k = 0; k < MEM_UNIT; k++)
+		sum += *(volatile unsigned long *)(p + k * MEM_LINE);
+	__asm__ volatile("" : : "r"(sum));
+	m->off = (m->off + MEM_UNIT * MEM_LINE) & (m->size - 1);
+	*count += MEM_UNIT;
+}
+
+KERNEL_INLINE void chase_work(volatile unsigned long long *count,
+                              void *state)
+{
+	struct membuf *m = state;
+	void **p = m->chase;
+	int k;
+
+	for (k = 0; k < MEM_UNIT; k++)
+		p = *p;
+	m->chase = p;
+	*count += MEM_UNIT;
+}
+
+KERNEL_INLINE unsigned long kernel_loops(struct sample *samples,
+                                         struct overrun *ovr,
+                                         size_t numsamples,
+                                         ticks tickinterval, ticks start,
+                                         void (*work)(volatile unsigned long long *,
+                                                      void *),
+                                         void *state, ticks (*now)(void),
+                                         const int live)
+{
+	unsigned long done;
+	volatile unsigned long long count;
+	unsigned long total_count = 0;
+	ticks ticknow, ticklast, tickend;
+	struct tel_thread *tel = live ? telemetry : NULL;
+	uint64_t *progress = live ? sample_progress : NULL;
+
+	tickend = start;
+
+	for (done = 0; done < numsamples; done++) {
+		count = 0;
+		tickend += tickinterval;
+
+		for (ticknow = ticklast = now();
+			 ticknow < tickend; ticknow = now())
+			work(&count, state);
+
+		samples[done].ticklast = ticklast;
+		samples[done].count = count;
+		ovr[done].end = ticknow;
+		ovr[done].over = ticknow - tickend;
+		total_count += count;
+		if (live) {
+			tel_sample(tel, ticklast, count);
+			progress_sample(progress, done + 1);
+		}
+	}
+	return total_count;
+}
+
+/*
+ * FWQ, the other way around: a fixed amount of work per sample, and
+ * count is the ticks it took. Samples start back to back from start.
+ */
+KERNEL_INLINE unsigned long kernel_fwq(struct sample *samples,
+                                       size_t numsamples,
+                                       unsigned long long units, ticks start,
+                                       void (*work)(volatile unsigned long long *,
+                                                    void *),
+                                       void *state, ticks (*now)(void),
+                                       const int live)
+{
+	unsigned long done;
+	unsigned long long u;
+	volatile unsigned long long count;
+	unsigned long total_ticks = 0;
+	ticks tickstart, tickend;
+	uint64_t *progress = live ? sample_progress : NULL;
+
+	while (now() < start)
+		;
+	for (done = 0; done < numsamples; done++) {
+		count = 0;
+		tickstart = now();
+		for (u = 0; u < units; u++)
+			work(&count, state);
+		tickend = now();
+
+		samples[done].ticklast = tickstart;
+		samples[done].count = tickend - tickstart;
+		total_ticks += tickend - tickstart;
+		if (live)
+			progress_sample(progress, done + 1);
+	}
+	return total_ticks;
+}
+
+/*
+ * kernel's loops and fwq for each timer, without and with (live_) the
+ * per-sample updates, and its rows of the table below
+ */
+#define KERNEL_LOOPS_AS(timer, kernel, attr, live, name) \
+	attr static unsigned long kernel##_##timer##_##name##loops( \
+		struct sample *samples, struct overrun *ovr, \
+		size_t numsamples, ticks tickinterval, ticks start, \
+		void *state) \
+	{ \
+		return kernel_loops(samples, ovr, numsamples, tickinterval, \
+		                    start, kernel##_work, state, \
+		                    timer##_timer, live); \
+	} \
+	attr static unsigned long kernel##_##timer##_##name##fwq( \
+		struct sample *samples, size_t numsamples, \
+		unsigned long long units, ticks start, void *state) \
+	{ \
+		return kernel_fwq(samples, numsamples, units, start, \
+		                  kernel##_work, state, timer##_timer, live); \
+	}
+#define KERNEL_LOOPS(timer, kernel, attr) \
+	KERNEL_LOOPS_AS(timer, kernel, attr, 0, ) \
+	KERNEL_LOOPS_AS(timer, kernel, attr, 1, live_)
+#define KERNEL_ROW(timer, kernel) kernel##_##timer##_loops,
+#define LIVE_ROW(timer, kernel) kernel##_##timer##_live_loops,
+#define FWQ_ROW(timer, kernel) kernel##_##timer##_fwq,
+#define LIVE_FWQ_ROW(timer, kernel) kernel##_##timer##_live_fwq,
+#define LOOPS(kernel) \
+	{{FOR_TIMERS(KERNEL_ROW, kernel)}, {FOR_TIMERS(LIVE_ROW, kernel)}}, \
+	{{FOR_TIMERS(FWQ_ROW, kernel)}, {FOR_TIMERS(LIVE_FWQ_ROW, kernel)}}
+
+FOR_TIMERS(KERNEL_LOOPS, int32, )
+FOR_TIMERS(KERNEL_LOOPS, int8, )
+FOR_TIMERS(KERNEL_LOOPS, int16, )
+FOR_TIMERS(KERNEL_LOOPS, int64, )
+FOR_TIMERS(KERNEL_LOOPS, float, )
+#if defined(__GNUC__) && defined(__x86_64__)
+FOR_TIMERS(KERNEL_LOOPS, avx2, __attribute__((target("avx2"))))
+FOR_TIMERS(KERNEL_LOOPS, avx512, __attribute__((target("avx512f"))))
+#endif
+FOR_TIMERS(KERNEL_LOOPS, stream, )
+FOR_TIMERS(KERNEL_LOOPS, chase, )
+
+unsigned long main_loops(struct sample *samples, struct overrun *ovr,
+                         size_t numsamples, ticks tickinterval, ticks start)
+{
+	return int32_ticks_loops(samples, ovr, numsamples, tickinterval, start,
+	                         NULL);
+}
+
+static void stream_init(struct membuf *m, unsigned int seed)
+{
+	memset(m->buf, 1, m->size);
+	m->off = 0;
+}
+
+/* one random cycle through every line: Sattolo's shuffle */
+static void chase_init(struct membuf *m, unsigned int seed)
+{
+	size_t i, j, t, n = m->size / MEM_LINE;
+	size_t *perm;
+
+	perm = malloc(n * sizeof(*perm));
+	assert(perm);
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = (((size_t)rand_r(&seed) << 31) | rand_r(&seed)) % i;
+		t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+	for (i = 0; i < n; i++)
+		*(void **)(m->buf + perm[i] * MEM_LINE) =
+			m->buf + perm[(i + 1) % n] * MEM_LINE;
+	free(perm);
+	m->chase = (void **)m->buf;
+}
+
+/* the first is the default */
+const struct kernel kernels[] = {
+	{"int", "32 volatile integer adds and 31 subtracts", LOOPS(int32)},
+	{"int8", "as int, 8 and 7", LOOPS(int8)},
+	{"int16", "as int, 16 and 15", LOOPS(int16)},
+	{"int64", "as int, 64 and 63", LOOPS(int64)},
+	{"float", "as int, on a volatile double", LOOPS(float)},
+#if defined(__GNUC__) && defined(__x86_64__)
+	{"avx2", "32 dependent 256-bit double adds", LOOPS(avx2), have_avx2},
+	{"avx512", "32 dependent 512-bit double adds", LOOPS(avx512),
+	 have_avx512},
+#endif
+	{"stream-l1", "read L1-sized buffer, count lines", LOOPS(stream),
+	 NULL, 1, stream_init},
+	{"stream-l2", "read L2-sized buffer, count lines", LOOPS(stream),
+	 NULL, 2, stream_init},
+	{"stream-llc", "read LLC-sized buffer, count lines", LOOPS(stream),
+	 NULL, 3, stream_init},
+	{"stream-dram", "read DRAM-sized buffer, count lines", LOOPS(stream),
+	 NULL, 4, stream_init},
+	{"chase-l1", "pointer chase in L1-sized buffer, count lines",
+	 LOOPS(chase), NULL, 1, chase_init},
+	{"chase-l2", "pointer chase in L2-sized buffer, count lines",
+	 LOOPS(chase), NULL, 2, chase_init},
+	{"chase-llc", "pointer chase in LLC-sized buffer, count lines",
+	 LOOPS(chase), NULL, 3, chase_init},
+	{"chase-dram", "pointer chase in DRAM-sized buffer, count lines",
+	 LOOPS(chase), NULL, 4, chase_init},
+	{NULL}
+};
+
+/*
+ * Half of the cache at that level, so our own code and stack fit too,
+ * rounded down to a power of 2 for the stream mask. DRAM is 8 times
+ * the LLC, and at least 256M. Call on the core that will run it.
+ */
+size_t kernel_bufsize(const struct kernel *k)
+{
+	static const size_t fallback[] = {0, 32 << 10, 1 << 20, 32 << 20};
+	size_t want, size;
+
+	if (k->level < 4) {
+		want = cache_size(k->level);
+		if (!want)
+			want = fallback[k->level];
+		want /= 2;
+	} else {
+		want = cache_size(3);
+		if (!want)
+			want = fallback[3];
+		want *= 8;
+		if (want < (256 << 20))
+			want = 256 << 20;
+	}
+	for (size = 4096; size * 2 <= want; size *= 2)
+		;
+	return size;
+}
+
+const struct kernel *find_kernel(const char *name)
+{
+	const struct kernel *k;
+
+	for (k = kernels; k->name; k++)
+		if (!strcmp(k->name, name))
+			return k;
+	return NULL;
+}
+
+/*
+ * Streaming: same loop, but each sample goes to the ring for the drain
+ * thread to write out, so the run length is not bounded by memory.
+ */
+unsigned long stream_loops(struct ring *ring, size_t numsamples,
+                           ticks tickinterval, ticks start,
+                           volatile int *stop)
 {
 	int k;
 	unsigned long done;
 	volatile unsigned long long count;
 	unsigned long total_count = 0;
 	ticks ticknow, ticklast, tickend;
+	struct tel_thread *tel = telemetry;
+	struct thread_hist *hists = histograms;
+
+	tickend = start;
+
+	for (done = 0; (!numsamples || done < numsamples) && !*stop; done++) {
+		count = 0;
+		tickend += tickinterval;
 
-	tickend = getticks();
+		for (ticknow = ticklast = getticks();
+			 ticknow < tickend; ticknow = getticks()) {
+			for (k = 0; k < ITERCOUNT; k++)
+				count++;
+			for (k = 0; k < (ITERCOUNT - 1); k++)
+				count--;
+		}
+
+		ring_push(ring, ticklast, count);
+		total_count += count;
+		tel_sample(tel, ticklast, count);
+		hist_sample(hists, ticknow - ticklast, count);
+	}
+	return total_count;
+}
+
+/*
+ * Event mode: the same loop, but a sample is only kept if it is low,
+ * as part of an event; see ftqevent.h. All the bookkeeping is in the
+ * gap between samples, and for a normal sample it is a compare and a
+ * store into the context history.
+ */
+unsigned long event_loops(struct event_log *log, size_t numsamples,
+                          ticks tickinterval, ticks start, volatile int *stop)
+{
+	int k, i;
+	unsigned long done;
+	volatile unsigned long long count;
+	unsigned long total_count = 0;
+	unsigned long long c, peak = 0, thresh = 0;
+	unsigned long long hist[EVENT_CONTEXT];
+	unsigned int nc = log->ncontext;
+	struct event *e = NULL, *post = NULL, spill;
+	ticks ticknow, ticklast, tickend;
+	struct tel_thread *tel = telemetry;
+	struct thread_hist *hists = histograms;
+
+	tickend = start;
+
+	for (done = 0; (!numsamples || done < numsamples) && !*stop; done++) {
+		count = 0;
+		tickend += tickinterval;
+
+		for (ticknow = ticklast = getticks();
+			 ticknow < tickend; ticknow = getticks()) {
+			for (k = 0; k < ITERCOUNT; k++)
+				count++;
+			for (k = 0; k < (ITERCOUNT - 1); k++)
+				count--;
+		}
+
+		c = count;
+		total_count += c;
+		tel_sample(tel, ticklast, c);
+		hist_sample(hists, ticknow - ticklast, c);
+		if (c > peak) {
+			peak = c;
+			thresh = peak * log->pct / 100;
+		}
+		if (c < thresh) {
+			if (!e) {
+				/* no room: still count its lost work */
+				if (log->n < log->max) {
+					e = &log->events[log->n++];
+				} else {
+					e = &spill;
+					log->dropped++;
+				}
+				memset(e, 0, sizeof(*e));
+				e->first = done;
+				e->start = ticklast;
+				e->min = c;
+				e->nbefore = done < nc ? done : nc;
+				for (i = 0; i < e->nbefore; i++)
+					e->before[i] = hist[(done - e->nbefore + i)
+					                    % EVENT_CONTEXT];
+				post = NULL;
+			}
+			e->nsamples++;
+			e->lost += peak - c;
+			e->peak = peak;
+			if (c < e->min)
+				e->min = c;
+			log->lost += peak - c;
+		} else if (e) {
+			/* the sample that ends it is the first after it */
+			e->end = ticklast;
+			post = e == &spill ? NULL : e;
+			e = NULL;
+			if (post && nc)
+				post->after[post->nafter++] = c;
+		} else if (post && post->nafter < nc) {
+			post->after[post->nafter++] = c;
+		}
+		hist[done % EVENT_CONTEXT] = c;
+	}
+	/* still low when we stopped */
+	if (e)
+		e->end = tickend;
+	log->samples = done;
+	log->peak = peak;
+	return total_count;
+}
+
+/*
+ * Triggered capture: the same loop again; see ftqtrig.h. Between
+ * samples: a store into the ring and the summary, and the trigger test.
+ * Freezing a segment copies the ring, once per trigger.
+ */
+unsigned long trigger_loops(struct trig *t, size_t numsamples,
+                            ticks tickinterval, ticks start,
+                            volatile int *stop)
+{
+	int k;
+	unsigned long done;
+	volatile unsigned long long count;
+	unsigned long total_count = 0;
+	unsigned long long c, peak = 0, thresh = 0, i, pre;
+	unsigned int reason;
+	size_t post = 0;
+	struct trig_segment *seg = NULL;
+	struct trig_summary *sum = NULL;
+	ticks ticknow, ticklast, tickend;
+	struct tel_thread *tel = telemetry;
+	struct thread_hist *hists = histograms;
+
+	tickend = start;
+
+	for (done = 0; (!numsamples || done < numsamples) && !*stop; done++) {
+		count = 0;
+		tickend += tickinterval;
+
+		for (ticknow = ticklast = getticks();
+			 ticknow < tickend; ticknow = getticks()) {
+			for (k = 0; k < ITERCOUNT; k++)
+				count++;
+			for (k = 0; k < (ITERCOUNT - 1); k++)
+				count--;
+		}
+
+		c = count;
+		total_count += c;
+		tel_sample(tel, ticklast, c);
+		hist_sample(hists, ticknow - ticklast, c);
+		if (c > peak) {
+			peak = c;
+			thresh = peak * t->pct / 100;
+		}
+
+		/* the summary this sample belongs to */
+		if (!sum || sum->n == t->decimate) {
+			if (t->nsums < t->maxsums) {
+				sum = &t->sums[t->nsums++];
+				sum->start = ticklast;
+				sum->n = 0;
+				sum->min = ~0ULL;
+				sum->max = 0;
+				sum->sum = 0;
+			} else {
+				sum = NULL;
+				t->dropped_sums++;
+			}
+		}
+		if (sum) {
+			sum->n++;
+			sum->sum += c;
+			if (c < sum->min)
+				sum->min = c;
+			if (c > sum->max)
+				sum->max = c;
+		}
+
+		if (post) {
+			seg->samples[seg->n].ticklast = ticklast;
+			seg->samples[seg->n++].count = c;
+			post--;
+		} else {
+			reason = 0;
+			if (c < thresh)
+				reason |= TRIG_LOW;
+			/* this sample started late: the last one ran over */
+			if (t->late && ticklast > tickend - tickinterval + t->late)
+				reason |= TRIG_LATE;
+			if (reason && t->nsegs < t->maxsegs) {
+				seg = &t->segs[t->nsegs++];
+				pre = done < t->pre ? done : t->pre;
+				seg->trigger = done;
+				seg->first = done - pre;
+				seg->reason = reason;
+				seg->n = 0;
+				for (i = seg->first; i < done; i++)
+					seg->samples[seg->n++] = t->ring[i & t->mask];
+				seg->samples[seg->n].ticklast = ticklast;
+				seg->samples[seg->n++].count = c;
+				post = t->post;
+			} else if (reason) {
+				t->dropped_segs++;
+			}
+		}
+		t->ring[done & t->mask].ticklast = ticklast;
+		t->ring[done & t->mask].count = c;
+	}
+	t->samples = done;
+	t->peak = peak;
+	return total_count;
+}
+
+/*
+ * With hardware counters: the same loop again, reading every counter at
+ * each sample boundary, outside the counting loop. The reads land in the
+ * gap between samples, like the stores do.
+ */
+unsigned long pmu_loops(struct sample *samples, unsigned long long *pmc,
+                        size_t numsamples, ticks tickinterval, ticks start,
+                        struct pmu *pmu)
+{
+	int k, i, n = pmu->n;
+	unsigned long done;
+	volatile unsigned long long count;
+	unsigned long total_count = 0;
+	unsigned long long last[PMU_MAX], now;
+	int have[PMU_MAX];
+	ticks ticknow, ticklast, tickend;
+	struct tel_thread *tel = telemetry;
+	struct thread_hist *hists = histograms;
+	uint64_t *progress = sample_progress;
+
+	tickend = start;
+	for (i = 0; i < n; i++)
+		have[i] = !pmu_read(pmu, i, &last[i]);
 
 	for (done = 0; done < numsamples; done++) {
 		count = 0;
@@ -47,9 +761,42 @@ unsigned long main_loops(struct sample *samples, size_t numsamples,
 				count--;
 		}
 
-		samples[done + offset].ticklast = ticklast;
-		samples[done + offset].count = count;
+		/* a delta needs a good read at both ends */
+		for (i = 0; i < n; i++) {
+			if (pmu_read(pmu, i, &now) < 0) {
+				pmc[done * n + i] = PMU_NONE;
+				have[i] = 0;
+				continue;
+			}
+			pmc[done * n + i] = have[i] ? now - last[i] : PMU_NONE;
+			last[i] = now;
+			have[i] = 1;
+		}
+		samples[done].ticklast = ticklast;
+		samples[done].count = count;
 		total_count += count;
+		tel_sample(tel, ticklast, count);
+		hist_sample(hists, ticknow - ticklast, count);
+		progress_sample(progress, done + 1);
 	}
 	return total_count;
 }
+
+/* ticks to read all the counters once, as the loop above does. */
+double pmu_read_cost(struct pmu *pmu)
+{
+	unsigned long long sink = 0, v = 0;
+	ticks start, end;
+	int k, i;
+
+	start = getticks();
+	for (k = 0; k < 1000; k++)
+		for (i = 0; i < pmu->n; i++) {
+			pmu_read(pmu, i, &v);
+			sink += v;
+		}
+	end = getticks();
+	/* keep the reads */
+	__asm__ volatile("" : : "r"(sink));
+	return (end - start) / 1000.0;
+}
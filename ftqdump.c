@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * ftqdump.c : convert binary ftq output (ftq -b) to the text format.
+ *
+ * With no options, each file is written to stdout, one after another.
+ * With -w, foo.bin becomes foo.dat next to it, which is what ftq would
+ * have written in text mode.
+ *
+ * A sweep archive (ftq -A) is taken apart the same way: thread N of
+ * cell C in foo.arc becomes foo_cC_N.dat, and -i lists the cells.
+ */
+#include "ftqbin.h"
+
+#include <getopt.h>
+
+static void usage(char *av0)
+{
+	fprintf(stderr, "usage: %s [-w] [-i (header info only)] "
+	        "file.bin|file.arc...\n", av0);
+	exit(EXIT_FAILURE);
+}
+
+static void info(struct ftqbin *fb, const char *name)
+{
+	const struct ftqbin_header *h = fb->hdr;
+
+	printf("%s: version %u, thread %d, core %d\n",
+	       name, h->version, h->thread, h->core);
+	printf("  %llu samples at %f Hz, %g ticks per ns\n",
+	       (unsigned long long)h->numsamples, h->frequency, h->ticksperns);
+	if (fb->numsamples < h->numsamples)
+		printf("  unfinished: %zu samples stored\n", fb->numsamples);
+	else if (h->flags & FTQBIN_LIVE)
+		printf("  written in place, as it ran\n");
+	printf("  total count %llu, max possible work %llu\n",
+	       (unsigned long long)h->total_count,
+	       (unsigned long long)h->max_work);
+	printf("  samples on node %d, %lluK pages\n", h->node,
+	       (unsigned long long)h->pagesize >> 10);
+	if (fb->npmc)
+		printf("  %d hardware counter columns\n", fb->npmc);
+	if (fb->ovr)
+		printf("  overrun records%s\n",
+		       fb->ovrtext ? ", as text columns" : "");
+}
+
+static char *datname(const char *name)
+{
+	size_t len = strlen(name);
+	char *out = malloc(len + 5);
+
+	assert(out);
+	strcpy(out, name);
+	if (len > 4 && !strcmp(out + len - 4, ".bin"))
+		out[len - 4] = 0;
+	strcat(out, ".dat");
+	return out;
+}
+
+/* write fb's text to out, or to stdout if out is NULL */
+static int dump(struct ftqbin *fb, const char *out)
+{
+	FILE *f = stdout;
+
+	if (out) {
+		f = fopen(out, "w");
+		if (!f) {
+			fprintf(stderr, "%s: %m\n", out);
+			return -1;
+		}
+		/* the samples are read once, in order */
+		setvbuf(f, NULL, _IOFBF, 1 << 20);
+	}
+	if (ftqbin_write_text(fb, f) < 0 || (out && fclose(f))) {
+		fprintf(stderr, "%s: write failed\n", out ? out : "stdout");
+		return -1;
+	}
+	return 0;
+}
+
+static int dump_archive(const char *name, int write_files, int info_only)
+{
+	const struct ftqarc_entry *e;
+	struct ftqarc fa;
+	struct ftqbin fb;
+	size_t i, len = strlen(name);
+	char *out = malloc(len + 32);
+	int ret = 0;
+
+	assert(out);
+	if (ftqarc_open(&fa, name) < 0) {
+		free(out);
+		return -1;
+	}
+	if (info_only) {
+		printf("%s: archive version %u, %zu files\n", name,
+		       fa.hdr->version, fa.n);
+		fwrite(fa.meta, 1, fa.hdr->metasize, stdout);
+	}
+	if (len > 4 && !strcmp(name + len - 4, ".arc"))
+		len -= 4;
+	for (i = 0; i < fa.n; i++) {
+		e = &fa.ent[i];
+		if (info_only) {
+			printf("  cell %u thread %d/%d core %d: %s kernel, %g Hz, "
+			       "cpus %.64s\n", e->cell, e->thread, e->threads,
+			       e->core, e->kernel, 1e9 / e->interval, e->cpus);
+			continue;
+		}
+		if (ftqarc_member(&fa, i, &fb) < 0) {
+			ret = -1;
+			continue;
+		}
+		snprintf(out, len + 32, "%.*s_c%u_%d.dat", (int)len, name,
+		         e->cell, e->thread);
+		if (dump(&fb, write_files ? out : NULL) < 0)
+			ret = -1;
+		ftqbin_close(&fb);
+	}
+	ftqarc_close(&fa);
+	free(out);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct ftqbin fb;
+	int write_files = 0, info_only = 0;
+	int c, i, ret = 0;
+	char *out;
+
+	while ((c = getopt(argc, argv, "wih")) != -1) {
+		switch (c) {
+			case 'w':
+				write_files = 1;
+				break;
+			case 'i':
+				info_only = 1;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc; i++) {
+		if (ftqarc_is(argv[i])) {
+			if (dump_archive(argv[i], write_files, info_only) < 0)
+				ret = 1;
+			continue;
+		}
+		if (ftqbin_open(&fb, argv[i]) < 0) {
+			ret = 1;
+			continue;
+		}
+		if (info_only) {
+			info(&fb, argv[i]);
+		} else if (write_files) {
+			out = datname(argv[i]);
+			if (dump(&fb, out) < 0)
+				ret = 1;
+			free(out);
+		} else if (dump(&fb, NULL) < 0) {
+			ret = 1;
+		}
+		ftqbin_close(&fb);
+	}
+	return ret;
+}
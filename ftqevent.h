@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Event mode: instead of every sample, keep only the dips. The loop
+ * tracks the peak count seen so far; a run of samples below pct percent
+ * of it is one event, with the samples around it as context. Normal
+ * samples cost a compare and are gone, so a run can last for days.
+ */
+#include "ftq.h"
+
+/* most samples of context kept on each side of an event */
+#define EVENT_CONTEXT 4
+#define DEFAULT_EVENTS 32768
+
+struct event {
+	/* sample number, and ticklast, of the first low sample */
+	unsigned long long first;
+	ticks start;
+	/* ticklast of the first sample after it */
+	ticks end;
+	unsigned long long nsamples;
+	/* sum of peak - count over the event, and the lowest count */
+	unsigned long long lost;
+	unsigned long long min;
+	unsigned long long peak;
+	/* counts before and after; ncontext of each, fewer at the edges */
+	unsigned int nbefore, nafter;
+	unsigned long long before[EVENT_CONTEXT];
+	unsigned long long after[EVENT_CONTEXT];
+};
+
+struct event_log {
+	struct event *events;
+	size_t max, n;
+	/* events there was no room for */
+	unsigned long long dropped;
+	unsigned int pct, ncontext;
+	/* results: samples taken, the peak, and all the lost work */
+	unsigned long long samples;
+	unsigned long long peak;
+	unsigned long long lost;
+};
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Histograms each measuring thread keeps: of its samples'
+ * counts, and of how long each sample really ran. They are log-bucketed,
+ * like HdrHistogram: below 2 * HIST_SUB every value has its own bucket,
+ * and above that a bucket is 1 / HIST_SUB of its power of two wide, so
+ * a value reads back within 1 / HIST_SUB of itself. Adding one is a
+ * count of leading zeros, a shift and an increment, for any value.
+ */
+#include <stdint.h>
+
+#include "ftq.h"
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t n;
+	uint64_t min, max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct thread_hist {
+	struct hist count;
+	/* ticks from a sample's first clock read to the one that ended it */
+	struct hist length;
+};
+
+/*
+ * this thread's, if any; set before the loops that keep them as they go
+ * run. The kernel and FWQ loops keep every sample, so theirs are filled
+ * in afterwards by hist_samples.
+ */
+extern __thread struct thread_hist *histograms;
+
+static __inline__ unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+static __inline__ void hist_add(struct hist *h, uint64_t v)
+{
+	if (!h->n || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->n++;
+	h->bucket[hist_bucket(v)]++;
+}
+
+static __inline__ void hist_sample(struct thread_hist *h, ticks length,
+                                   unsigned long long count)
+{
+	if (!h)
+		return;
+	hist_add(&h->count, count);
+	hist_add(&h->length, length);
+}
+
+/* n samples after the run; without ovr, as for FWQ, count is the length */
+static __inline__ void hist_samples(struct thread_hist *h,
+                                    const struct sample *s,
+                                    const struct overrun *ovr, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		hist_sample(h, ovr ? ovr[i].end - s[i].ticklast : s[i].count,
+		            s[i].count);
+}
+
+static __inline__ void hist_merge(struct hist *to, const struct hist *from)
+{
+	int i;
+
+	if (!from->n)
+		return;
+	if (!to->n || from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->n += from->n;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
+}
+
+/* the pct percentile, nearest rank: the middle of its bucket */
+static __inline__ uint64_t hist_value(const struct hist *h, double pct)
+{
+	uint64_t rank = pct / 100 * h->n + 0.999999, seen = 0, v;
+	unsigned int i, shift;
+
+	if (!h->n)
+		return 0;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i < 2 * HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	v = ((uint64_t)(i - shift * HIST_SUB) << shift) + (1ULL << shift) / 2;
+	return v < h->min ? h->min : v > h->max ? h->max : v;
+}
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Output formatting for sample files, without stdio.
+ *
+ * A text file line is "%lld %lld\n" of the time in ns since the first
+ * sample and the count; this produces exactly the same bytes, several
+ * times faster, into a buffer that goes out in big write()s. Nothing
+ * here allocates, so every thread can format its own file at once.
+ *
+ * Keep this file OS-independent.
+ */
+#include "ftq.h"
+#include "pmu.h"
+
+#include <errno.h>
+
+/* per call, on the stack */
+#define OUTBUF_SIZE (256 * 1024)
+/*
+ * the longest line: up to 4 + PMU_MAX 20 character numbers, and spaces;
+ * PMU_MAXLINE has room for the two overrun columns
+ */
+#define MAXLINE PMU_MAXLINE
+
+static const char digits2[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static char *format_ull(char *p, unsigned long long v)
+{
+	char tmp[20], *t = tmp + sizeof(tmp);
+	size_t len;
+
+	while (v >= 100) {
+		unsigned int i = (v % 100) * 2;
+
+		v /= 100;
+		*--t = digits2[i + 1];
+		*--t = digits2[i];
+	}
+	if (v >= 10) {
+		*--t = digits2[v * 2 + 1];
+		*--t = digits2[v * 2];
+	} else {
+		*--t = '0' + v;
+	}
+	len = tmp + sizeof(tmp) - t;
+	memcpy(p, t, len);
+	return p + len;
+}
+
+static char *format_ll(char *p, long long v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return format_ull(p, -(unsigned long long)v);
+	}
+	return format_ull(p, v);
+}
+
+/* one "time count\n" line at p; returns the end. p needs MAXLINE bytes. */
+char *format_sample(char *p, long long ns, long long count)
+{
+	p = format_ll(p, ns);
+	*p++ = ' ';
+	p = format_ll(p, count);
+	*p++ = '\n';
+	return p;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t amt;
+
+	while (len) {
+		amt = write(fd, p, len);
+		if (amt < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += amt;
+		len -= amt;
+	}
+	return 0;
+}
+
+/*
+ * n samples as text lines, times relative to base. Extra columns: with
+ * ovr, when each sample ended (same base) and ns past its quantum;
+ * then npmc PMU counters per sample, if there are any.
+ */
+int write_samples_cols(int fd, const struct sample *s,
+                       const struct overrun *ovr,
+                       const unsigned long long *pmc, int npmc, size_t n,
+                       ticks base, double ticksperns)
+{
+	char buf[OUTBUF_SIZE], *p = buf;
+	size_t i;
+	int j;
+
+	for (i = 0; i < n; i++) {
+		if (p + MAXLINE > buf + sizeof(buf)) {
+			if (write_all(fd, buf, p - buf) < 0)
+				return -1;
+			p = buf;
+		}
+		p = format_sample(p, (ticks)((s[i].ticklast - base) / ticksperns),
+		                  s[i].count);
+		if (ovr || npmc) {
+			/* back up over the newline */
+			p--;
+			if (ovr) {
+				*p++ = ' ';
+				p = format_ll(p, (ticks)((ovr[i].end - base)
+				                         / ticksperns));
+				*p++ = ' ';
+				p = format_ll(p, (ticks)(ovr[i].over / ticksperns));
+			}
+			for (j = 0; j < npmc; j++) {
+				*p++ = ' ';
+				if (pmc[i * npmc + j] == PMU_NONE)
+					p = format_ll(p, -1);
+				else
+					p = format_ull(p, pmc[i * npmc + j]);
+			}
+			*p++ = '\n';
+		}
+	}
+	return write_all(fd, buf, p - buf);
+}
+
+int write_samples(int fd, const struct sample *s, size_t n, ticks base,
+                  double ticksperns)
+{
+	return write_samples_cols(fd, s, NULL, NULL, 0, n, base, ticksperns);
+}
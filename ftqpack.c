@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Packed samples: the encoder and the decoder. See ftqpack.h.
+ *
+ * Keep this file OS-independent.
+ */
+#include "ftqpack.h"
+
+struct buf {
+	uint8_t *p;
+	size_t len, max;
+};
+
+static void grow(struct buf *b, size_t n)
+{
+	while (b->len + n > b->max) {
+		b->max = b->max ? 2 * b->max : 1 << 16;
+		b->p = realloc(b->p, b->max);
+		assert(b->p);
+	}
+}
+
+static void put_varint(struct buf *b, uint64_t v)
+{
+	grow(b, 10);
+	while (v >= 0x80) {
+		b->p[b->len++] = v | 0x80;
+		v >>= 7;
+	}
+	b->p[b->len++] = v;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* 0 for 0, else the number of bits v needs */
+static int bits(uint64_t v)
+{
+	return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+/*
+ * The width that packs v smallest, and that size in bits. At width w,
+ * values from 2^w - 1 up are exceptions: w bits, then a varint. 64 has
+ * no exceptions.
+ */
+static int pick_width(const uint64_t *v, size_t n, size_t *size)
+{
+	size_t cnt[66] = { 0 }, best_cost = 64 * n, cost, extra;
+	int w, best = 64;
+	size_t i;
+
+	/* by the bits in v + 1, which is 65 for the one value that wraps */
+	for (i = 0; i < n; i++)
+		cnt[v[i] == UINT64_MAX ? 65 : bits(v[i] + 1)]++;
+	/* down from 63, adding the values that stop fitting; in bits */
+	extra = (cnt[64] + cnt[65]) * 8 * 10;
+	for (w = 63; w >= 0; w--) {
+		cost = n * w + extra;
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = w;
+		}
+		extra += cnt[w] * 8 * ((w + 6) / 7);
+	}
+	*size = best_cost;
+	return best;
+}
+
+static void put_bits(struct buf *b, struct buf *exc, const uint64_t *v,
+                     size_t n, int w)
+{
+	uint64_t acc = 0, x, esc = w == 64 ? 0 : (1ULL << w) - 1;
+	int nbits = 0, k;
+	size_t i;
+
+	grow(b, (n * w + 7) / 8 + 8);
+	/* at width 0, everything is an exception: all varints */
+	for (i = 0; i < n; i++) {
+		x = v[i];
+		if (w < 64 && x >= esc) {
+			put_varint(exc, x);
+			x = esc;
+		}
+		acc |= x << nbits;
+		if (nbits + w >= 64) {
+			for (k = 0; k < 8; k++)
+				b->p[b->len++] = acc >> (8 * k);
+			acc = nbits ? x >> (64 - nbits) : 0;
+			nbits += w - 64;
+		} else {
+			nbits += w;
+		}
+	}
+	for (k = 0; k < nbits; k += 8)
+		b->p[b->len++] = acc >> k;
+}
+
+/* the k-th smallest of v, which it reorders; Wirth's */
+static int64_t select_k(int64_t *v, long n, long k)
+{
+	long l = 0, m = n - 1, i, j;
+	int64_t x, t;
+
+	while (l < m) {
+		x = v[k];
+		i = l;
+		j = m;
+		do {
+			while (v[i] < x)
+				i++;
+			while (x < v[j])
+				j--;
+			if (i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		} while (i <= j);
+		if (j < k)
+			l = i;
+		if (k < i)
+			m = j;
+	}
+	return v[k];
+}
+
+/* work has room for 3 * FTQPACK_BLOCK values */
+static void encode_block(struct buf *b, const struct sample *s, size_t n,
+                         uint64_t *peak, uint64_t *work)
+{
+	uint64_t *tv = work, *cv = tv + FTQPACK_BLOCK, *rv = cv + FTQPACK_BLOCK;
+	uint64_t p = *peak;
+	struct buf exc = { 0 };
+	int64_t step = 0;
+	size_t i, size, rsize;
+	int tw, cw, rw, flags = 0;
+
+	/* the usual step is the median; a late start makes a short one */
+	for (i = 1; i < n; i++)
+		rv[i - 1] = s[i].ticklast - s[i - 1].ticklast;
+	if (n > 1)
+		step = select_k((int64_t *)rv, n - 1, (n - 1) / 2);
+	for (i = 1; i < n; i++)
+		tv[i - 1] = zigzag((int64_t)(s[i].ticklast - s[i - 1].ticklast)
+		                   - step);
+	put_varint(b, n);
+	put_varint(b, s[0].ticklast);
+	put_varint(b, zigzag(step));
+	put_varint(b, *peak);
+	for (i = 0; i < n; i++) {
+		cv[i] = zigzag((int64_t)(p - s[i].count));
+		rv[i] = s[i].count;
+		if (s[i].count > p)
+			p = s[i].count;
+	}
+	*peak = p;
+	tw = pick_width(tv, n - 1, &size);
+	cw = pick_width(cv, n, &size);
+	rw = pick_width(rv, n, &rsize);
+	if (rsize < size) {
+		cv = rv;
+		cw = rw;
+		flags |= FTQPACK_RAW;
+	}
+	grow(b, 3);
+	b->p[b->len++] = tw;
+	b->p[b->len++] = cw;
+	b->p[b->len++] = flags;
+	put_bits(b, &exc, tv, n - 1, tw);
+	put_bits(b, &exc, cv, n, cw);
+	grow(b, exc.len);
+	memcpy(b->p + b->len, exc.p, exc.len);
+	b->len += exc.len;
+	free(exc.p);
+}
+
+/* n samples, packed, in a malloc'd buffer of *size bytes */
+void *ftqpack_encode(const struct sample *samples, size_t n, size_t *size)
+{
+	struct buf b = { 0 };
+	struct ftqpack_header hdr;
+	uint64_t *work, *index, peak = 0;
+	size_t i, nblocks = (n + FTQPACK_BLOCK - 1) / FTQPACK_BLOCK;
+
+	work = malloc(3 * FTQPACK_BLOCK * sizeof(*work));
+	index = malloc((nblocks + 1) * sizeof(*index));
+	assert(work && index);
+	grow(&b, sizeof(hdr));
+	b.len = sizeof(hdr);
+	for (i = 0; i < nblocks; i++) {
+		index[i] = b.len;
+		encode_block(&b, samples + i * FTQPACK_BLOCK,
+		             i < nblocks - 1 ? FTQPACK_BLOCK
+		                             : n - i * FTQPACK_BLOCK,
+		             &peak, work);
+	}
+	/* the index is 8 byte aligned, so it can be used in place */
+	grow(&b, 8 + nblocks * sizeof(*index));
+	while (b.len % 8)
+		b.p[b.len++] = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FTQPACK_MAGIC, sizeof(hdr.magic));
+	hdr.version = FTQPACK_VERSION;
+	hdr.block = FTQPACK_BLOCK;
+	hdr.numsamples = n;
+	hdr.nblocks = nblocks;
+	hdr.indexoff = b.len;
+	memcpy(b.p + b.len, index, nblocks * sizeof(*index));
+	b.len += nblocks * sizeof(*index);
+	hdr.size = b.len;
+	memcpy(b.p, &hdr, sizeof(hdr));
+	free(work);
+	free(index);
+	*size = b.len;
+	return b.p;
+}
+
+/* 0 if pack looks whole, in len bytes */
+int ftqpack_check(const void *pack, size_t len)
+{
+	const struct ftqpack_header *hdr = pack;
+	const uint64_t *index;
+	uint64_t i;
+
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, FTQPACK_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != FTQPACK_VERSION || !hdr->block
+	    || hdr->block > FTQPACK_BLOCK || hdr->size > len
+	    || hdr->indexoff % 8 || hdr->indexoff > hdr->size
+	    || hdr->nblocks != (hdr->numsamples + hdr->block - 1) / hdr->block
+	    || hdr->nblocks > (hdr->size - hdr->indexoff) / sizeof(*index))
+		return -1;
+	index = (const uint64_t *)((const char *)pack + hdr->indexoff);
+	for (i = 0; i < hdr->nblocks; i++)
+		if (index[i] < sizeof(*hdr) || index[i] >= hdr->indexoff
+		    || (i && index[i] <= index[i - 1]))
+			return -1;
+	return 0;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+/* 8 bytes, low first */
+static __inline__ uint64_t load(const uint8_t *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	       | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32
+	       | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48
+	       | (uint64_t)p[7] << 56;
+}
+
+/*
+ * The w bits at bit pos of p. This reads up to 8 bytes past them, which
+ * is fine inside a pack: the index, at least 8 bytes of it, comes last.
+ */
+static __inline__ uint64_t get(const uint8_t *p, uint64_t pos, int w,
+                               uint64_t mask)
+{
+	const uint8_t *q = p + (pos >> 3);
+	unsigned int sh = pos & 7;
+	uint64_t v = load(q) >> sh;
+
+	if (w > 56 && sh)
+		v |= (uint64_t)q[8] << (64 - sh);
+	return v & mask;
+}
+
+/* a block, from p to end, into s; n is how many it should have */
+static int decode_block(const uint8_t *p, const uint8_t *end,
+                        struct sample *s, size_t n)
+{
+	uint64_t m, t, step, peak, x, tmask, cmask, pos;
+	const uint8_t *tp, *cp, *exc;
+	size_t i;
+	int tw, cw, raw;
+
+	if (get_varint(&p, end, &m) < 0 || m != n || !n
+	    || get_varint(&p, end, &t) < 0 || get_varint(&p, end, &step) < 0
+	    || get_varint(&p, end, &peak) < 0 || end - p < 3)
+		return -1;
+	tw = p[0];
+	cw = p[1];
+	raw = p[2] & FTQPACK_RAW;
+	if (tw > 64 || cw > 64
+	    || ((n - 1) * tw + 7) / 8 + (n * cw + 7) / 8 > end - p - 3)
+		return -1;
+	tp = p + 3;
+	cp = tp + ((n - 1) * tw + 7) / 8;
+	exc = cp + (n * cw + 7) / 8;
+	tmask = tw == 64 ? ~0ULL : (1ULL << tw) - 1;
+	cmask = cw == 64 ? ~0ULL : (1ULL << cw) - 1;
+	step = unzigzag(step);
+
+	/* at width 0, everything is an exception; all ones is 0 */
+	s[0].ticklast = t;
+	for (i = 1, pos = 0; i < n; i++, pos += tw) {
+		x = tw ? get(tp, pos, tw, tmask) : 0;
+		if (x == tmask && tw < 64 && get_varint(&exc, end, &x) < 0)
+			return -1;
+		t += step + unzigzag(x);
+		s[i].ticklast = t;
+	}
+	for (i = 0, pos = 0; i < n; i++, pos += cw) {
+		x = cw ? get(cp, pos, cw, cmask) : 0;
+		if (x == cmask && cw < 64 && get_varint(&exc, end, &x) < 0)
+			return -1;
+		s[i].count = raw ? x : peak - unzigzag(x);
+		if (s[i].count > peak)
+			peak = s[i].count;
+	}
+	return 0;
+}
+
+/* samples first to first + n - 1 into out; pack has been checked */
+int ftqpack_decode(const void *pack, size_t first, size_t n,
+                   struct sample *out)
+{
+	const struct ftqpack_header *hdr = pack;
+	const uint64_t *index = (const uint64_t *)((const char *)pack
+	                                           + hdr->indexoff);
+	struct sample *tmp = NULL, *s;
+	size_t b, start, len, from, take;
+	const uint8_t *p;
+
+	if (first + n > hdr->numsamples || first + n < first)
+		return -1;
+	while (n) {
+		b = first / hdr->block;
+		start = b * hdr->block;
+		len = b < hdr->nblocks - 1 ? hdr->block : hdr->numsamples - start;
+		from = first - start;
+		take = len - from < n ? len - from : n;
+		/* whole blocks go straight to out */
+		s = out;
+		if (from || take < len) {
+			if (!tmp) {
+				tmp = malloc(hdr->block * sizeof(*tmp));
+				assert(tmp);
+			}
+			s = tmp;
+		}
+		p = (const uint8_t *)pack + index[b];
+		if (decode_block(p, (const uint8_t *)pack
+		                    + (b < hdr->nblocks - 1 ? index[b + 1]
+		                                            : hdr->indexoff),
+		                 s, len) < 0) {
+			free(tmp);
+			return -1;
+		}
+		if (s == tmp)
+			memcpy(out, tmp + from, take * sizeof(*out));
+		out += take;
+		first += take;
+		n -= take;
+	}
+	free(tmp);
+	return 0;
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Packed samples, for ftq -b -z: the samples section of a binary file,
+ * in a few bits per sample. The overrun records are packed the same
+ * way, end as the time and over as the count.
+ *
+ * Samples go in blocks of FTQPACK_BLOCK. Each block starts with, as
+ * varints: how many samples it has, the first one's time, the median
+ * time from one sample to the next in the block (zigzag), and the
+ * running peak count before it; then a byte each for the two bit
+ * widths, and one of flags. Then the times, as each step's difference
+ * from the median one (zigzag), and the counts, as their distance below the
+ * running peak (zigzag, since a new peak is above it) or, with
+ * FTQPACK_RAW, as they are, each bit-packed at its width, low bits
+ * first. A value too wide for its width is written as all ones, and the
+ * value itself follows as a varint after both bit fields, in order;
+ * the encoder picks the widths, and FTQPACK_RAW, that make the block
+ * smallest.
+ *
+ * After the blocks, the index: the offset of each from the header. A
+ * block has everything it needs, so any range of samples can be decoded
+ * without the ones before it.
+ *
+ * Byte order is that of the machine, as for the rest of the file.
+ */
+#include <stdint.h>
+
+#include "ftq.h"
+
+#define FTQPACK_MAGIC   "FTQPACK"
+#define FTQPACK_VERSION 1
+#define FTQPACK_BLOCK   1024
+/* block flags: the counts are not relative to the peak */
+#define FTQPACK_RAW     1
+
+struct ftqpack_header {
+	char magic[8];
+	uint32_t version;
+	/* samples per block; the last one may have fewer */
+	uint32_t block;
+	uint64_t numsamples;
+	uint64_t nblocks;
+	/* from the start of the header, as is everything */
+	uint64_t indexoff;
+	uint64_t size;
+};
+
+/* ftqpack.c */
+void *ftqpack_encode(const struct sample *samples, size_t n, size_t *size);
+int ftqpack_check(const void *pack, size_t len);
+int ftqpack_decode(const void *pack, size_t first, size_t n,
+                   struct sample *out);
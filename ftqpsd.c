@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * ftqpsd.c : Welch power spectral density of ftq output files.
+ *
+ * Replaces scripts/welch.R and the octave pwelch line in the headers:
+ *	ftqpsd ftq_*.dat
+ * writes ftq_N.psd.csv (freq,psd) next to each input, matching
+ *	pwelch(x(:,2),[],[],[],fs)
+ * The sample frequency comes from the file header unless -f is given.
+ * Takes text (.dat) or binary (.bin, from ftq -b) files.
+ *
+ * Files are processed in parallel; a single file has its segments
+ * spread across the threads instead.
+ */
+#include "ftqbin.h"
+#include "welch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct welch_opts opts;
+static int binary_out;
+static int to_stdout;
+static int numjobs;
+static char **files;
+static int numfiles;
+static int nextfile;
+static int failed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(char *av0)
+{
+	fprintf(stderr,
+	        "usage: %s [-w window] [-v overlap] [-n nfft] "
+	        "[-W hamming|hann|rect] [-k (keep the mean)] [-f fs] "
+	        "[-j threads] [-b (binary output)] [-s (stdout)] file...\n",
+	        av0);
+	exit(EXIT_FAILURE);
+}
+
+/* the count column of a text file, and the frequency from its header. */
+static double *load_dat(const char *name, size_t *np, double *fs)
+{
+	size_t n = 0, max = 1 << 16;
+	char *map, *p, *end;
+	struct stat st;
+	double *x;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %m\n", name);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty\n", name);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %m\n", name);
+		return NULL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	x = malloc(max * sizeof(*x));
+	assert(x);
+	for (p = map, end = map + st.st_size; p < end; p++) {
+		if (*p == '#') {
+			if (!strncmp(p, "# Frequency ", 12))
+				*fs = strtod(p + 12, NULL);
+		} else if (*p != '\n') {
+			unsigned long long v = 0;
+
+			/* "time count": skip the time */
+			while (p < end && *p != ' ' && *p != '\n')
+				p++;
+			while (p < end && *p == ' ')
+				p++;
+			while (p < end && *p >= '0' && *p <= '9')
+				v = v * 10 + *p++ - '0';
+			if (n == max) {
+				max *= 2;
+				x = realloc(x, max * sizeof(*x));
+				assert(x);
+			}
+			x[n++] = v;
+		}
+		while (p < end && *p != '\n')
+			p++;
+	}
+	munmap(map, st.st_size);
+	*np = n;
+	return x;
+}
+
+static double *load_bin(const char *name, size_t *np, double *fs)
+{
+	struct ftqbin fb;
+	double *x;
+	size_t i;
+
+	if (ftqbin_open(&fb, name) < 0)
+		return NULL;
+	x = malloc(fb.numsamples * sizeof(*x));
+	assert(x);
+	for (i = 0; i < fb.numsamples; i++)
+		x[i] = fb.samples[i].count;
+	*np = fb.numsamples;
+	*fs = fb.hdr->frequency;
+	ftqbin_close(&fb);
+	return x;
+}
+
+static int is_bin(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && !strcmp(name + len - 4, ".bin");
+}
+
+static char *psdname(const char *name)
+{
+	size_t len = strlen(name);
+	char *out = malloc(len + 16);
+
+	assert(out);
+	strcpy(out, name);
+	if (len > 4 && (!strcmp(out + len - 4, ".dat")
+	                || !strcmp(out + len - 4, ".bin")))
+		out[len - 4] = 0;
+	strcat(out, binary_out ? ".psd" : ".psd.csv");
+	return out;
+}
+
+static int do_file(const char *name, int nthreads)
+{
+	struct welch_opts o = opts;
+	struct welch_psd psd;
+	double fs = 0, *x;
+	char *out;
+	size_t n;
+	FILE *f;
+	int ret;
+
+	x = is_bin(name) ? load_bin(name, &n, &fs) : load_dat(name, &n, &fs);
+	if (!x)
+		return -1;
+	if (!o.fs)
+		o.fs = fs;
+	if (!o.fs) {
+		fprintf(stderr, "%s: no frequency in the header; use -f\n", name);
+		free(x);
+		return -1;
+	}
+	o.nthreads = nthreads;
+	ret = welch(x, n, &o, &psd);
+	free(x);
+	if (ret < 0) {
+		fprintf(stderr, "%s: welch failed\n", name);
+		return -1;
+	}
+
+	if (to_stdout) {
+		f = stdout;
+		out = NULL;
+	} else {
+		out = psdname(name);
+		f = fopen(out, "w");
+		if (!f) {
+			fprintf(stderr, "%s: %m\n", out);
+			free(out);
+			welch_free(&psd);
+			return -1;
+		}
+	}
+	if (binary_out)
+		ret = welch_write_bin(f, &psd, o.wintype);
+	else
+		ret = welch_write_csv(f, &psd);
+	if (f != stdout && fclose(f))
+		ret = -1;
+	if (ret < 0)
+		fprintf(stderr, "%s: write failed\n", out ? out : "stdout");
+	free(out);
+	welch_free(&psd);
+	return ret;
+}
+
+static void *job(void *arg)
+{
+	int nthreads = (uintptr_t)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		i = nextfile++;
+		pthread_mutex_unlock(&lock);
+		if (i >= numfiles)
+			break;
+		if (do_file(files[i], nthreads) < 0) {
+			pthread_mutex_lock(&lock);
+			failed = 1;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	int c, i, jobs, per;
+
+	while ((c = getopt(argc, argv, "w:v:n:W:kf:j:bsh")) != -1) {
+		switch (c) {
+			case 'w':
+				opts.window = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				opts.overlap = strtoul(optarg, NULL, 0);
+				if (!opts.overlap)
+					opts.overlap = WELCH_NO_OVERLAP;
+				break;
+			case 'n':
+				opts.nfft = strtoul(optarg, NULL, 0);
+				break;
+			case 'W':
+				opts.wintype = welch_wintype(optarg);
+				if (opts.wintype < 0)
+					usage(argv[0]);
+				break;
+			case 'k':
+				opts.detrend = WELCH_DETREND_NONE;
+				break;
+			case 'f':
+				opts.fs = strtod(optarg, NULL);
+				break;
+			case 'j':
+				numjobs = atoi(optarg);
+				break;
+			case 'b':
+				binary_out = 1;
+				break;
+			case 's':
+				to_stdout = 1;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	files = &argv[optind];
+	numfiles = argc - optind;
+	if (!numfiles)
+		usage(argv[0]);
+	if (to_stdout && numfiles > 1) {
+		fprintf(stderr, "ERROR: -s takes only one file\n");
+		exit(EXIT_FAILURE);
+	}
+	if (numjobs <= 0)
+		numjobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numjobs <= 0)
+		numjobs = 1;
+
+	/* files in parallel; leftover threads go to the segments */
+	jobs = numjobs < numfiles ? numjobs : numfiles;
+	per = numjobs / jobs;
+	threads = calloc(jobs, sizeof(*threads));
+	assert(threads);
+	for (i = 1; i < jobs; i++)
+		if (pthread_create(&threads[i], NULL, job, (void *)(uintptr_t)per)) {
+			fprintf(stderr, "ERROR: pthread_create() failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	job((void *)(uintptr_t)per);
+	for (i = 1; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Single producer, single consumer ring of samples, for streaming mode.
+ * The measuring thread is the only producer and the drain thread the
+ * only consumer, so all we need are acquire/release on the indices.
+ *
+ * The producer never waits: if the ring is full the sample is dropped
+ * and counted. head and tail only ever increase; size is a power of 2.
+ */
+#include "ftq.h"
+
+#define RING_CACHELINE 64
+
+struct ring {
+	struct sample *buf;
+	unsigned long mask;
+	/* producer side */
+	unsigned long head __attribute__((aligned(RING_CACHELINE)));
+	unsigned long tailcache;
+	unsigned long long dropped;
+	/* consumer side */
+	unsigned long tail __attribute__((aligned(RING_CACHELINE)));
+};
+
+static inline int ring_push(struct ring *r, ticks ticklast,
+                            unsigned long long count)
+{
+	unsigned long head = r->head;
+	struct sample *s;
+
+	if (head - r->tailcache > r->mask) {
+		r->tailcache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - r->tailcache > r->mask) {
+			__atomic_store_n(&r->dropped, r->dropped + 1,
+			                 __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+	s = &r->buf[head & r->mask];
+	s->ticklast = ticklast;
+	s->count = count;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Consumer: returns how many samples are ready, and where the first one
+ * is. The run is contiguous, so it may be less than everything that is
+ * ready if the ring wraps. Call ring_done() when finished with them.
+ */
+static inline size_t ring_peek(struct ring *r, struct sample **s)
+{
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = r->tail;
+	size_t n = head - tail;
+	size_t toend = r->mask + 1 - (tail & r->mask);
+
+	*s = &r->buf[tail & r->mask];
+	return n < toend ? n : toend;
+}
+
+static inline void ring_done(struct ring *r, size_t n)
+{
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long long ring_dropped(struct ring *r)
+{
+	return __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,570 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * ftqsweep.c : run ftq over placements that cover the cpu topology.
+ *
+ * Reads the topology of the cpus we may use from Linux sysfs and runs
+ * ftq -c for each level: a lone core in each L3 domain, SMT siblings
+ * together, every core of an L3 domain, NUMA node and socket, and pairs
+ * across domains. Then it reads the files back and prints a table of
+ * the work each group of threads lost, so the levels can be compared.
+ *
+ * Anything after -- goes to ftq as is, e.g. -- -f 20000 -k stream-l2,
+ * but not -W: FWQ counts are ticks, not work.
+ */
+#define _GNU_SOURCE
+#include "ftq.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+
+/* a dip is a sample below this percent of its thread's peak */
+#define DIP_PCT 90
+
+struct cpu {
+	int cpu, core, pkg, node;
+	/* the L3's shared_cpu_list, as a name for it; "" if none */
+	char l3[64];
+	/* the first of its SMT siblings */
+	int first;
+};
+
+/* one row of the table */
+struct row {
+	char level[16];
+	char group[160];
+	int threads;
+	double work, worst, min, dips;
+};
+
+static struct cpu *cpus;
+static int ncpus;
+static struct row *rows;
+static int nrows, maxrows;
+
+static const char *ftq = "./ftq.linux";
+static const char *prefix = "sweep";
+static char *samples = "100000";
+static char **extra;
+static int nextra;
+
+static void usage(char *av0)
+{
+	fprintf(stderr, "usage: %s [-f ftq] [-o prefix] [-n samples] "
+	        "[-l core,smt,l3,node,socket,cross] [-- ftq args]\n", av0);
+	exit(EXIT_FAILURE);
+}
+
+static FILE *sysfs(const char *fmt, va_list ap)
+{
+	char name[256];
+
+	vsnprintf(name, sizeof(name), fmt, ap);
+	return fopen(name, "r");
+}
+
+static int read_int(int def, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *f;
+	int v;
+
+	va_start(ap, fmt);
+	f = sysfs(fmt, ap);
+	va_end(ap);
+	if (!f)
+		return def;
+	if (fscanf(f, "%d", &v) != 1)
+		v = def;
+	fclose(f);
+	return v;
+}
+
+/* the first line, less the newline; "" if there is none */
+static void read_str(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *f;
+
+	buf[0] = 0;
+	va_start(ap, fmt);
+	f = sysfs(fmt, ap);
+	va_end(ap);
+	if (!f)
+		return;
+	if (!fgets(buf, size, f))
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(f);
+}
+
+static void read_l3(struct cpu *c)
+{
+	int i, level;
+
+	c->l3[0] = 0;
+	for (i = 0; ; i++) {
+		level = read_int(-1, "/sys/devices/system/cpu/cpu%d/cache/"
+		                 "index%d/level", c->cpu, i);
+		if (level < 0)
+			return;
+		if (level == 3)
+			break;
+	}
+	read_str(c->l3, sizeof(c->l3), "/sys/devices/system/cpu/cpu%d/"
+	         "cache/index%d/shared_cpu_list", c->cpu, i);
+}
+
+static int read_node(int cpu)
+{
+	char name[256];
+	struct dirent *d;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(name);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir)))
+		if (sscanf(d->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/* the cpus we may run on, and where each sits */
+static void read_topology(void)
+{
+	cpu_set_t *set = CPU_ALLOC(CPU_LIST_MAX);
+	size_t size = CPU_ALLOC_SIZE(CPU_LIST_MAX);
+	struct cpu *c;
+	int i, j;
+
+	assert(set);
+	CPU_ZERO_S(size, set);
+	if (sched_getaffinity(0, size, set) < 0) {
+		perror("sched_getaffinity");
+		exit(EXIT_FAILURE);
+	}
+	cpus = calloc(CPU_COUNT_S(size, set), sizeof(*cpus));
+	assert(cpus);
+	for (i = 0; i < CPU_LIST_MAX; i++) {
+		if (!CPU_ISSET_S(i, size, set))
+			continue;
+		c = &cpus[ncpus++];
+		c->cpu = i;
+		c->core = read_int(i, "/sys/devices/system/cpu/cpu%d/topology/"
+		                   "core_id", i);
+		c->pkg = read_int(0, "/sys/devices/system/cpu/cpu%d/topology/"
+		                  "physical_package_id", i);
+		c->node = read_node(i);
+		read_l3(c);
+		c->first = i;
+		for (j = 0; j < ncpus - 1; j++)
+			if (cpus[j].pkg == c->pkg && cpus[j].core == c->core) {
+				c->first = cpus[j].first;
+				break;
+			}
+	}
+	CPU_FREE(set);
+}
+
+/* what a level groups cpus by */
+enum { BY_L3, BY_NODE, BY_PKG, NKINDS };
+static const char *kind_name[NKINDS] = { "l3", "node", "socket" };
+
+static void domain_key(const struct cpu *c, int kind, char *buf, size_t size)
+{
+	if (kind == BY_L3 && c->l3[0])
+		snprintf(buf, size, "%s", c->l3);
+	else if (kind == BY_NODE)
+		snprintf(buf, size, "%d", c->node);
+	else
+		snprintf(buf, size, "%d", c->pkg);
+}
+
+/* dom[i] is the domain of cpus[i], numbered as they first appear */
+static int domains(int kind, int *dom)
+{
+	char a[64], b[64];
+	int i, j, n = 0;
+
+	for (i = 0; i < ncpus; i++) {
+		domain_key(&cpus[i], kind, a, sizeof(a));
+		dom[i] = -1;
+		for (j = 0; j < i; j++) {
+			domain_key(&cpus[j], kind, b, sizeof(b));
+			if (!strcmp(a, b)) {
+				dom[i] = dom[j];
+				break;
+			}
+		}
+		if (dom[i] < 0)
+			dom[i] = n++;
+	}
+	return n;
+}
+
+/* an earlier kind that splits the cpus the same way makes this one moot */
+static int same_as_earlier(int kind)
+{
+	int *a = calloc(ncpus, sizeof(*a)), *b = calloc(ncpus, sizeof(*b));
+	int k, same = 0;
+
+	assert(a && b);
+	domains(kind, a);
+	for (k = 0; k < kind && !same; k++) {
+		domains(k, b);
+		same = !memcmp(a, b, ncpus * sizeof(*a));
+	}
+	free(a);
+	free(b);
+	return same;
+}
+
+/* the first cpu of domain d, and of each core in it */
+static int domain_cpus(const int *dom, int d, int *list)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ncpus; i++)
+		if (dom[i] == d && cpus[i].first == cpus[i].cpu)
+			list[n++] = cpus[i].cpu;
+	return n;
+}
+
+/* ftq -c list -n samples -o prefix_tag, and the -- args */
+static int run_ftq(const char *tag, const int *list, int n)
+{
+	char cpulist[8 * CPU_LIST_MAX], pfx[256], **argv;
+	int i, argc = 0, status;
+	size_t len = 0;
+	pid_t pid;
+
+	for (i = 0; i < n; i++)
+		len += snprintf(cpulist + len, sizeof(cpulist) - len, "%s%d",
+		                i ? "," : "", list[i]);
+	snprintf(pfx, sizeof(pfx), "%s_%s", prefix, tag);
+	argv = calloc(nextra + 8, sizeof(*argv));
+	assert(argv);
+	argv[argc++] = (char *)ftq;
+	argv[argc++] = "-c";
+	argv[argc++] = cpulist;
+	argv[argc++] = "-n";
+	argv[argc++] = samples;
+	argv[argc++] = "-o";
+	argv[argc++] = pfx;
+	for (i = 0; i < nextra; i++)
+		argv[argc++] = extra[i];
+	fprintf(stderr, "%s: -c %s\n", tag, cpulist);
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid) {
+		execv(ftq, argv);
+		fprintf(stderr, "%s: %m\n", ftq);
+		_exit(EXIT_FAILURE);
+	}
+	free(argv);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+	    || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: ftq failed\n", tag);
+		return -1;
+	}
+	return 0;
+}
+
+/* the counts in a text sample file */
+static unsigned long long *read_dat(const char *name, size_t *n)
+{
+	unsigned long long *c = NULL, count;
+	size_t max = 0;
+	char line[4096];
+	long long t;
+	FILE *f;
+
+	*n = 0;
+	f = fopen(name, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %m\n", name);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "# fwq:", 6)) {
+			fprintf(stderr, "%s: an FWQ run; its counts are ticks, "
+			        "not work\n", name);
+			exit(EXIT_FAILURE);
+		}
+		if (line[0] == '#' || sscanf(line, "%lld %llu", &t, &count) != 2)
+			continue;
+		if (*n == max) {
+			max = max ? 2 * max : 65536;
+			c = realloc(c, max * sizeof(*c));
+			assert(c);
+		}
+		c[(*n)++] = count;
+	}
+	fclose(f);
+	return c;
+}
+
+/*
+ * A row for threads first to first + n - 1 of the run: the work done
+ * as a percent of each thread's peak, on average and for the worst
+ * thread, the lowest sample, and the dips per thousand samples. A
+ * thread that did no work at all has no peak and is left out.
+ */
+static void report(const char *level, const char *group, const char *tag,
+                   int first, int n)
+{
+	unsigned long long *c, peak, low, sum, dips, all = 0, alldips = 0;
+	char name[512];
+	struct row *r;
+	size_t i, ns;
+	double work, works = 0;
+	int t, counted = 0;
+
+	if (nrows == maxrows) {
+		maxrows = maxrows ? 2 * maxrows : 64;
+		rows = realloc(rows, maxrows * sizeof(*rows));
+		assert(rows);
+	}
+	r = &rows[nrows];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->level, sizeof(r->level), "%s", level);
+	snprintf(r->group, sizeof(r->group), "%s", group);
+	r->worst = r->min = 100;
+	for (t = first; t < first + n; t++) {
+		snprintf(name, sizeof(name), "%s_%s_%d.dat", prefix, tag, t);
+		c = read_dat(name, &ns);
+		if (!c)
+			return;
+		peak = sum = dips = 0;
+		low = c[0];
+		for (i = 0; i < ns; i++) {
+			sum += c[i];
+			if (c[i] > peak)
+				peak = c[i];
+			if (c[i] < low)
+				low = c[i];
+		}
+		for (i = 0; i < ns; i++)
+			if (c[i] < peak * DIP_PCT / 100)
+				dips++;
+		free(c);
+		if (!peak)
+			continue;
+		work = 100.0 * sum / (peak * ns);
+		works += work;
+		counted++;
+		if (work < r->worst)
+			r->worst = work;
+		if (100.0 * low / peak < r->min)
+			r->min = 100.0 * low / peak;
+		all += ns;
+		alldips += dips;
+	}
+	r->threads = counted;
+	r->work = counted ? works / counted : 0;
+	if (!counted)
+		r->worst = r->min = 0;
+	r->dips = all ? 1000.0 * alldips / all : 0;
+	nrows++;
+}
+
+/* alone: the first core of each L3 domain, all at once */
+static void level_core(void)
+{
+	int *dom = calloc(ncpus, sizeof(*dom)), *list;
+	char group[160];
+	int i, nd;
+
+	assert(dom);
+	nd = domains(BY_L3, dom);
+	list = calloc(nd, sizeof(*list));
+	assert(list);
+	for (i = 0; i < nd; i++)
+		domain_cpus(dom, i, list + i);
+	if (run_ftq("core", list, nd) == 0)
+		for (i = 0; i < nd; i++) {
+			snprintf(group, sizeof(group), "cpu %d", list[i]);
+			report("core", group, "core", i, 1);
+		}
+	free(list);
+	free(dom);
+}
+
+/* both (all) siblings of the first SMT core in each L3 domain, at once */
+static void level_smt(void)
+{
+	int *dom = calloc(ncpus, sizeof(*dom)), *list, *start;
+	char group[160];
+	int i, j, d, nd, n = 0, ngroups = 0;
+	size_t len;
+
+	list = calloc(ncpus, sizeof(*list));
+	start = calloc(ncpus + 1, sizeof(*start));
+	assert(dom && list && start);
+	nd = domains(BY_L3, dom);
+	for (d = 0; d < nd; d++)
+		for (i = 0; i < ncpus; i++) {
+			if (dom[i] != d || cpus[i].first != cpus[i].cpu)
+				continue;
+			for (j = i + 1; j < ncpus; j++)
+				if (cpus[j].first == cpus[i].cpu)
+					break;
+			if (j == ncpus)
+				continue;
+			start[ngroups++] = n;
+			for (j = i; j < ncpus; j++)
+				if (cpus[j].first == cpus[i].cpu)
+					list[n++] = cpus[j].cpu;
+			break;
+		}
+	start[ngroups] = n;
+	if (!ngroups)
+		fprintf(stderr, "smt: no core with SMT siblings\n");
+	else if (run_ftq("smt", list, n) == 0)
+		for (i = 0; i < ngroups; i++) {
+			len = snprintf(group, sizeof(group), "cpus");
+			for (j = start[i]; j < start[i + 1]; j++)
+				len += snprintf(group + len, sizeof(group) - len,
+				                "%s%d", j == start[i] ? " " : ",",
+				                list[j]);
+			report("smt", group, "smt", start[i], start[i + 1] - start[i]);
+		}
+	free(start);
+	free(list);
+	free(dom);
+}
+
+/* a thread on each core of a domain, one domain at a time */
+static void level_domain(int kind)
+{
+	int *dom = calloc(ncpus, sizeof(*dom));
+	int *list = calloc(ncpus, sizeof(*list));
+	char tag[64], key[64], group[160];
+	int i, d, nd, n;
+
+	assert(dom && list);
+	nd = domains(kind, dom);
+	for (d = 0; d < nd; d++) {
+		n = domain_cpus(dom, d, list);
+		for (i = 0; dom[i] != d; i++)
+			;
+		domain_key(&cpus[i], kind, key, sizeof(key));
+		snprintf(tag, sizeof(tag), "%s_%d", kind_name[kind], d);
+		snprintf(group, sizeof(group), "%s %s", kind_name[kind], key);
+		if (run_ftq(tag, list, n) == 0)
+			report(kind_name[kind], group, tag, 0, n);
+	}
+	free(list);
+	free(dom);
+}
+
+/* the first core of the first domain with the first of each other one */
+static void level_cross(int kind)
+{
+	int *dom = calloc(ncpus, sizeof(*dom));
+	int *list = calloc(ncpus, sizeof(*list));
+	char tag[64], a[64], b[64], group[160];
+	int pair[2], i, d, nd;
+
+	assert(dom && list);
+	nd = domains(kind, dom);
+	domain_cpus(dom, 0, list);
+	pair[0] = list[0];
+	domain_key(&cpus[0], kind, a, sizeof(a));
+	for (d = 1; d < nd; d++) {
+		domain_cpus(dom, d, list);
+		pair[1] = list[0];
+		for (i = 0; dom[i] != d; i++)
+			;
+		domain_key(&cpus[i], kind, b, sizeof(b));
+		snprintf(tag, sizeof(tag), "cross_%s_%d", kind_name[kind], d);
+		snprintf(group, sizeof(group), "%s %s + %s", kind_name[kind], a, b);
+		if (run_ftq(tag, pair, 2) == 0)
+			report("cross", group, tag, 0, 2);
+	}
+	free(list);
+	free(dom);
+}
+
+static void print_table(FILE *f)
+{
+	int i;
+
+	fprintf(f, "%-8s %-40s %7s %8s %8s %8s %8s\n", "level", "group",
+	        "threads", "work%", "worst%", "min%", "dips/1k");
+	for (i = 0; i < nrows; i++)
+		fprintf(f, "%-8s %-40s %7d %8.3f %8.3f %8.3f %8.3f\n",
+		        rows[i].level, rows[i].group, rows[i].threads,
+		        rows[i].work, rows[i].worst, rows[i].min, rows[i].dips);
+}
+
+int main(int argc, char **argv)
+{
+	char *levels = "core,smt,l3,node,socket,cross";
+	char name[512];
+	int c, k;
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "f:o:n:l:h")) != -1) {
+		switch (c) {
+			case 'f':
+				ftq = optarg;
+				break;
+			case 'o':
+				prefix = optarg;
+				break;
+			case 'n':
+				samples = optarg;
+				break;
+			case 'l':
+				levels = optarg;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	extra = argv + optind;
+	nextra = argc - optind;
+	for (k = 0; k < nextra; k++)
+		if (!strncmp(extra[k], "-W", 2) || !strncmp(extra[k], "--fwq", 5)) {
+			fprintf(stderr, "ftqsweep compares work; FWQ (-W) counts "
+			        "are ticks\n");
+			exit(EXIT_FAILURE);
+		}
+
+	read_topology();
+	fprintf(stderr, "%d cpus\n", ncpus);
+	if (strstr(levels, "core"))
+		level_core();
+	if (strstr(levels, "smt"))
+		level_smt();
+	for (k = 0; k < NKINDS; k++)
+		if (strstr(levels, kind_name[k]) && !same_as_earlier(k))
+			level_domain(k);
+	if (strstr(levels, "cross"))
+		for (k = 0; k < NKINDS; k++)
+			if (!same_as_earlier(k))
+				level_cross(k);
+
+	print_table(stdout);
+	snprintf(name, sizeof(name), "%s_summary.txt", prefix);
+	f = fopen(name, "w");
+	if (!f) {
+		fprintf(stderr, "%s: %m\n", name);
+		exit(EXIT_FAILURE);
+	}
+	print_table(f);
+	fclose(f);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Live telemetry: a file (ftq -M path) mapped shared, with a slot per
+ * measuring thread that the thread updates after every sample. Each
+ * slot is a seqlock: seq is odd while the thread is writing, and a
+ * reader that sees it change, or odd, tries again. The writer never
+ * waits and makes no system calls; ftqtop is the reader.
+ */
+#include <stdint.h>
+
+#include "ftq.h"
+
+#define TEL_MAGIC   "FTQTEL\n"
+#define TEL_VERSION 1
+/* a dip is a sample below this percent of the peak */
+#define TEL_DIP_PCT 90
+
+struct tel_thread {
+	uint32_t seq;
+	int32_t thread;
+	int32_t core;
+	uint32_t pad;
+	uint64_t samples;
+	/* the last sample's start, and its count */
+	uint64_t now;
+	uint64_t last;
+	uint64_t peak;
+	uint64_t sum;
+	uint64_t dips;
+	/* longest time from one sample's start to the next's, in ticks */
+	uint64_t worst_gap;
+	/* writer only: the start of the sample before */
+	uint64_t prev;
+} __attribute__((aligned(64)));
+
+struct tel_header {
+	char magic[8];
+	uint32_t version;
+	int32_t nthreads;
+	int32_t pid;
+	/* set when the run is over */
+	int32_t done;
+	double ticksperns;
+	/* the sample interval, in ns */
+	uint64_t interval;
+	uint64_t epoch;
+	char kernel[32];
+	struct tel_thread threads[] __attribute__((aligned(64)));
+};
+
+/*
+ * this thread's slot, if there is telemetry; set before the loops run,
+ * which read it once and pass it to tel_sample
+ */
+extern __thread struct tel_thread *telemetry;
+
+static __inline__ void tel_sample(struct tel_thread *t, ticks ticklast,
+                                  unsigned long long count)
+{
+	uint32_t seq;
+
+	if (!t)
+		return;
+	seq = t->seq;
+	__atomic_store_n(&t->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (t->samples && ticklast - t->prev > t->worst_gap)
+		t->worst_gap = ticklast - t->prev;
+	t->prev = ticklast;
+	t->samples++;
+	t->now = ticklast;
+	t->last = count;
+	t->sum += count;
+	if (count > t->peak)
+		t->peak = count;
+	if (count < t->peak * TEL_DIP_PCT / 100)
+		t->dips++;
+	__atomic_store_n(&t->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * An update is a few stores, but its writer may be preempted; one still
+ * at it after this many tries (a good part of a second) has died.
+ */
+#define TEL_READ_TRIES (1L << 28)
+
+/*
+ * A consistent copy of a slot, or -1 if its writer stopped in the middle
+ * of an update and the slot is stale.
+ */
+static __inline__ int tel_read(const struct tel_thread *t,
+                               struct tel_thread *copy)
+{
+	uint32_t seq;
+	long tries = 0;
+
+	do {
+		while ((seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE)) & 1)
+			if (++tries > TEL_READ_TRIES)
+				return -1;
+		memcpy(copy, (const void *)t, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq
+	         && ++tries <= TEL_READ_TRIES);
+	return tries > TEL_READ_TRIES ? -1 : 0;
+}
@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * ftqtop.c : watch a running ftq (ftq -M file).
+ *
+ * Every interval, shows each thread's work rate since the last look, its
+ * last sample as a percent of its peak, the samples below TEL_DIP_PCT of
+ * the peak, and the longest time between two samples' starts. The first
+ * look, and -1, give the rate since the run started. With -m, writes one
+ * OpenMetrics text snapshot to stdout and exits, for scraping. A thread
+ * that died in the middle of an update is shown as stale, and left out
+ * of the snapshot.
+ */
+#include "ftqtel.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static void usage(char *av0)
+{
+	fprintf(stderr, "usage: %s [-i interval-sec] [-1 (once)] "
+	        "[-m (OpenMetrics)] telemetry-file\n", av0);
+	exit(EXIT_FAILURE);
+}
+
+static struct tel_header *attach(const char *name)
+{
+	struct tel_header *h;
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %m\n", name);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %m\n", name);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s: not an ftq telemetry file\n", name);
+		close(fd);
+		return NULL;
+	}
+	h = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %m\n", name);
+		return NULL;
+	}
+	if (memcmp(h->magic, TEL_MAGIC, sizeof(h->magic))) {
+		fprintf(stderr, "%s: not an ftq telemetry file\n", name);
+		return NULL;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (h->version != TEL_VERSION) {
+		fprintf(stderr, "%s: version %u, expected %u\n", name,
+		        h->version, TEL_VERSION);
+		return NULL;
+	}
+	if (h->nthreads < 1 || sizeof(*h) + h->nthreads
+	    * sizeof(h->threads[0]) > st.st_size) {
+		fprintf(stderr, "%s: truncated or corrupt\n", name);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * One metric family, from the uint64_t at off in each slot. Counters get
+ * _total on their samples. With a scale, the value is ticks, in seconds.
+ */
+static void family(struct tel_header *h, struct tel_thread *cur,
+                   const char *stale, const char *name, int counter,
+                   const char *help, size_t off, int scale)
+{
+	uint64_t v;
+	int i;
+
+	printf("# TYPE %s %s\n# HELP %s %s\n", name,
+	       counter ? "counter" : "gauge", name, help);
+	for (i = 0; i < h->nthreads; i++) {
+		if (stale[i])
+			continue;
+		v = *(uint64_t *)((char *)&cur[i] + off);
+		printf("%s%s{thread=\"%d\",core=\"%d\"} ", name,
+		       counter ? "_total" : "", cur[i].thread, cur[i].core);
+		if (scale)
+			printf("%.9f\n", v / h->ticksperns / 1e9);
+		else
+			printf("%llu\n", (unsigned long long)v);
+	}
+}
+
+static void openmetrics(struct tel_header *h, struct tel_thread *cur,
+                        const char *stale)
+{
+	family(h, cur, stale, "ftq_samples", 1, "Samples taken.",
+	       offsetof(struct tel_thread, samples), 0);
+	family(h, cur, stale, "ftq_work", 1, "Units of work done.",
+	       offsetof(struct tel_thread, sum), 0);
+	family(h, cur, stale, "ftq_dips", 1, "Samples below the dip threshold.",
+	       offsetof(struct tel_thread, dips), 0);
+	family(h, cur, stale, "ftq_peak_work", 0, "Most work done in one sample.",
+	       offsetof(struct tel_thread, peak), 0);
+	family(h, cur, stale, "ftq_last_work", 0, "Work done in the last sample.",
+	       offsetof(struct tel_thread, last), 0);
+	family(h, cur, stale, "ftq_worst_gap_seconds", 0,
+	       "Longest time between sample starts.",
+	       offsetof(struct tel_thread, worst_gap), 1);
+	printf("# TYPE ftq_interval_seconds gauge\n"
+	       "ftq_interval_seconds %.9f\n", h->interval / 1e9);
+	printf("# TYPE ftq_running gauge\nftq_running %d\n",
+	       !__atomic_load_n(&h->done, __ATOMIC_ACQUIRE));
+	printf("# EOF\n");
+}
+
+static void show(struct tel_header *h, struct tel_thread *cur,
+                 struct tel_thread *prev, const char *stale)
+{
+	double secs, rate;
+	ticks newest = 0;
+	int i;
+
+	for (i = 0; i < h->nthreads; i++)
+		if (!stale[i] && cur[i].now > newest)
+			newest = cur[i].now;
+	secs = newest > h->epoch ? (newest - h->epoch) / h->ticksperns / 1e9
+	                         : 0;
+	/* home, clear */
+	printf("\033[H\033[J");
+	printf("ftq pid %d: %s kernel, %d threads, %llu ns quanta, %.1f s%s\n\n",
+	       h->pid, h->kernel, h->nthreads, (unsigned long long)h->interval,
+	       secs, __atomic_load_n(&h->done, __ATOMIC_ACQUIRE)
+	             ? ", done" : "");
+	printf("%6s %5s %14s %14s %6s %10s %14s\n", "thread", "core",
+	       "samples", "work/s", "last%", "dips", "worst gap us");
+	for (i = 0; i < h->nthreads; i++) {
+		struct tel_thread *c = &cur[i], *p = &prev[i];
+
+		if (stale[i]) {
+			printf("%6d %5d %14s\n", h->threads[i].thread,
+			       h->threads[i].core, "stale");
+			continue;
+		}
+		rate = 0;
+		if (c->now > p->now)
+			rate = (c->sum - p->sum) / ((c->now - p->now)
+			                            / h->ticksperns / 1e9);
+		printf("%6d %5d %14llu %14.0f %6.1f %10llu %14.3f\n",
+		       c->thread, c->core, (unsigned long long)c->samples, rate,
+		       c->peak ? 100.0 * c->last / c->peak : 0.0,
+		       (unsigned long long)c->dips,
+		       c->worst_gap / h->ticksperns / 1e3);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct tel_thread *cur, *prev;
+	struct tel_header *h;
+	char *stale;
+	double secs = 1.0;
+	struct timespec ts;
+	int once = 0, om = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "i:1mh")) != -1) {
+		switch (c) {
+			case 'i':
+				secs = strtod(optarg, NULL);
+				break;
+			case '1':
+				once = 1;
+				break;
+			case 'm':
+				om = 1;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || secs <= 0)
+		usage(argv[0]);
+	h = attach(argv[optind]);
+	if (!h)
+		exit(EXIT_FAILURE);
+
+	cur = calloc(h->nthreads, sizeof(*cur));
+	prev = calloc(h->nthreads, sizeof(*prev));
+	stale = calloc(h->nthreads, 1);
+	assert(cur && prev && stale);
+	/* the first rates are since the start */
+	for (i = 0; i < h->nthreads; i++)
+		prev[i].now = h->epoch;
+	ts.tv_sec = secs;
+	ts.tv_nsec = (secs - ts.tv_sec) * 1e9;
+	for (;;) {
+		for (i = 0; i < h->nthreads; i++)
+			stale[i] = tel_read(&h->threads[i], &cur[i]) < 0;
+		if (om) {
+			openmetrics(h, cur, stale);
+			break;
+		}
+		show(h, cur, prev, stale);
+		if (once || __atomic_load_n(&h->done, __ATOMIC_ACQUIRE))
+			break;
+		memcpy(prev, cur, h->nthreads * sizeof(*cur));
+		nanosleep(&ts, NULL);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Triggered capture, like a scope: a ring of the last pre samples, and
+ * when a sample trips the trigger (count below pct percent of the peak
+ * so far, or a start more than late ticks behind schedule) the ring, the
+ * sample and the next post samples are frozen into a segment. Everything
+ * else only goes into min/mean/max summaries of every decimate samples.
+ */
+#include "ftq.h"
+
+#define DEFAULT_PRETRIGGER 1000
+#define DEFAULT_POSTTRIGGER 1000
+#define DEFAULT_DECIMATE 100000
+#define DEFAULT_SEGMENTS 64
+/* summaries kept when the run has no end */
+#define DEFAULT_SUMMARIES 262144
+
+/* why a segment was captured */
+#define TRIG_LOW 1
+#define TRIG_LATE 2
+
+struct trig_segment {
+	/* the sample that tripped it, and the first one kept */
+	unsigned long long trigger;
+	unsigned long long first;
+	unsigned int reason;
+	/* samples kept; pre + 1 + post, fewer at the edges */
+	size_t n;
+	struct sample *samples;
+};
+
+struct trig_summary {
+	ticks start;
+	unsigned long long n;
+	unsigned long long min, max, sum;
+};
+
+struct trig {
+	/* set up by the caller */
+	unsigned int pct;
+	ticks late;
+	size_t pre, post;
+	unsigned long long decimate;
+	struct sample *ring;
+	unsigned long mask;
+	struct trig_segment *segs;
+	size_t maxsegs;
+	struct trig_summary *sums;
+	size_t maxsums;
+	/* results */
+	size_t nsegs, nsums;
+	unsigned long long dropped_segs, dropped_sums;
+	unsigned long long samples, peak;
+};
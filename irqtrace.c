@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Interrupt timeline and attribution; see irqtrace.h.
+ *
+ * Sources are numbered in the order we first see them, so an event's
+ * src stays meaningful if lines come and go between reads. The sampler
+ * runs on a housekeeping core and is the only writer until it stops.
+ *
+ * Keep this file OS-independent; irq_snapshot() is the OS part.
+ */
+#include "irqtrace.h"
+
+#include <pthread.h>
+#include <time.h>
+
+static struct irqsnap snap;
+static char (*names)[IRQ_NAMELEN];
+static int nnames, maxnames;
+/* last count of each source on each column, and whether we have one */
+static unsigned long long *prev;
+static unsigned char *seen;
+static int prevcpus;
+/* period j is (periods[j - 1], periods[j]] */
+static ticks *periods;
+static int nperiods, maxperiods;
+static struct irqevent *events;
+static size_t nevents, maxevents;
+
+static pthread_t sampler;
+static volatile int sampler_stop;
+static unsigned long period_msec;
+static int sampler_core;
+
+static void *grow(void *p, size_t *max, size_t size)
+{
+	*max = *max ? *max * 2 : 1024;
+	p = realloc(p, *max * size);
+	assert(p);
+	return p;
+}
+
+static int source_index(const char *name, int hint)
+{
+	int i;
+	size_t max = maxnames;
+
+	if (hint < nnames && !strcmp(names[hint], name))
+		return hint;
+	for (i = 0; i < nnames; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	if (nnames == maxnames) {
+		names = grow(names, &max, sizeof(*names));
+		prev = realloc(prev, max * prevcpus * sizeof(*prev));
+		seen = realloc(seen, max * prevcpus);
+		assert(prev && seen);
+		memset(seen + maxnames * prevcpus, 0,
+		       (max - maxnames) * prevcpus);
+		maxnames = max;
+	}
+	strcpy(names[nnames], name);
+	return nnames++;
+}
+
+/* take a snapshot, and record what changed since the last one. */
+static void sample_irqs(void)
+{
+	size_t maxp = maxperiods;
+	int r, c, g;
+
+	if (irq_snapshot(&snap) < 0)
+		return;
+	if (snap.ncpu != prevcpus) {
+		/* first time, or cpus came or went: start over */
+		prevcpus = snap.ncpu;
+		free(prev);
+		free(seen);
+		prev = calloc(maxnames ? maxnames : 1, prevcpus * sizeof(*prev));
+		seen = calloc(maxnames ? maxnames : 1, prevcpus);
+		assert(prev && seen);
+	}
+	if (nperiods == maxperiods) {
+		periods = grow(periods, &maxp, sizeof(*periods));
+		maxperiods = maxp;
+	}
+	periods[nperiods] = readticks();
+
+	for (r = 0; r < snap.nsrc; r++) {
+		g = source_index(snap.name[r], r);
+		for (c = 0; c < snap.ncpu; c++) {
+			unsigned long long now = snap.count[r * snap.ncpu + c];
+			size_t ix = (size_t)g * prevcpus + c;
+
+			if (seen[ix] && now > prev[ix]) {
+				struct irqevent *e;
+
+				if (nevents == maxevents)
+					events = grow(events, &maxevents,
+					              sizeof(*events));
+				e = &events[nevents++];
+				e->tick = periods[nperiods];
+				e->period = nperiods;
+				e->src = g;
+				e->cpu = snap.cpu[c];
+				e->delta = now - prev[ix];
+			}
+			prev[ix] = now;
+			seen[ix] = 1;
+		}
+	}
+	nperiods++;
+}
+
+static void *sampler_thread(void *arg)
+{
+	struct timespec nap;
+
+	if (sampler_core >= 0)
+		wireme(sampler_core);
+	nap.tv_sec = period_msec / 1000;
+	nap.tv_nsec = (period_msec % 1000) * 1000000;
+	sample_irqs();
+	while (!sampler_stop) {
+		nanosleep(&nap, NULL);
+		sample_irqs();
+	}
+	return NULL;
+}
+
+int irqtrace_start(unsigned long period, int core)
+{
+	if (irq_snapshot(&snap) < 0) {
+		fprintf(stderr, "irqtrace: can not read interrupt counts\n");
+		return -1;
+	}
+	period_msec = period;
+	sampler_core = core;
+	if (pthread_create(&sampler, NULL, sampler_thread, NULL)) {
+		fprintf(stderr, "irqtrace: pthread_create failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+void irqtrace_stop(void)
+{
+	sampler_stop = 1;
+	pthread_join(sampler, NULL);
+}
+
+/* the timeline: one line per source per cpu per period it fired in. */
+int irqtrace_write(const char *name, ticks epoch, double ticksperns)
+{
+	FILE *f;
+	size_t i;
+
+	f = fopen(name, "w");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+	fprintf(f, "# irq timeline: %d periods of %lu msec, %d sources\n",
+	        nperiods, period_msec, nnames);
+	fprintf(f, "# time is ns since the common start; see the start "
+	        "skew in each sample file\n");
+	fprintf(f, "# columns: time cpu count source\n");
+	for (i = 0; i < nevents; i++)
+		fprintf(f, "%lld %d %llu %s\n",
+		        (long long)((long long)(events[i].tick - epoch) / ticksperns),
+		        events[i].cpu, events[i].delta, names[events[i].src]);
+	if (fclose(f)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+struct score {
+	int src;
+	int periods;
+	unsigned long long fired;
+	unsigned long long lost;
+};
+
+static int by_lost(const void *a, const void *b)
+{
+	const struct score *x = a, *y = b;
+
+	if (x->lost != y->lost)
+		return x->lost < y->lost ? 1 : -1;
+	return x->fired < y->fired ? 1 : x->fired > y->fired ? -1 : 0;
+}
+
+/*
+ * For each thread, lost work in a sample is max_count - count (for FWQ,
+ * the ticks it took over the least any took). Each
+ * period gets the lost work of the samples that started in it, and each
+ * source that fired on the thread's core in that period is charged all
+ * of it: this is coincidence, not blame, so the percentages can add up
+ * to more than 100.
+ */
+int irqtrace_rank(const char *name, const struct irqthread *threads,
+                  int numthreads)
+{
+	unsigned long long *winlost, total;
+	struct score *score;
+	const struct irqthread *t;
+	size_t i, e;
+	int j, k, n;
+	FILE *f;
+
+	f = fopen(name, "w");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	winlost = calloc(nperiods + 1, sizeof(*winlost));
+	score = calloc(nnames + 1, sizeof(*score));
+	assert(winlost && score);
+	fprintf(f, "# irq sources ranked by coincident lost work, per core\n");
+	fprintf(f, "# %d periods of %lu msec\n", nperiods, period_msec);
+
+	for (k = 0; k < numthreads; k++) {
+		t = &threads[k];
+		if (t->core < 0) {
+			fprintf(f, "\n# thread %d: core unknown, not ranked\n", k);
+			continue;
+		}
+		memset(winlost, 0, (nperiods + 1) * sizeof(*winlost));
+		total = 0;
+		for (i = 0, j = 0; i < t->numsamples; i++) {
+			unsigned long long lost = t->elapsed
+				? t->samples[i].count - t->max_count
+				: t->max_count - t->samples[i].count;
+
+			while (j < nperiods && periods[j] < t->samples[i].ticklast)
+				j++;
+			total += lost;
+			/* before the first read or after the last: nobody's */
+			if (j > 0 && j < nperiods)
+				winlost[j] += lost;
+		}
+		for (j = 0; j < nnames; j++) {
+			memset(&score[j], 0, sizeof(score[j]));
+			score[j].src = j;
+		}
+		for (e = 0; e < nevents; e++) {
+			if (events[e].cpu != t->core)
+				continue;
+			score[events[e].src].lost += winlost[events[e].period];
+			score[events[e].src].fired += events[e].delta;
+			score[events[e].src].periods++;
+		}
+		qsort(score, nnames, sizeof(*score), by_lost);
+
+		fprintf(f, "\n# thread %d, core %d: lost work %llu\n", k, t->core,
+		        total);
+		fprintf(f, "# %-40s %12s %8s %12s %6s\n", "source", "count",
+		        "periods", "lost", "%");
+		for (n = 0; n < nnames && score[n].fired; n++)
+			fprintf(f, "  %-40s %12llu %8d %12llu %6.1f\n",
+			        names[score[n].src], score[n].fired,
+			        score[n].periods, score[n].lost,
+			        total ? 100.0 * score[n].lost / total : 0.0);
+	}
+	free(winlost);
+	free(score);
+	if (fclose(f)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
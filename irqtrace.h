@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Interrupt attribution. A housekeeping thread snapshots the per-cpu
+ * interrupt and softirq counts every period, and keeps the per-cpu
+ * deltas, stamped with readticks() so they share the samples' time base.
+ * At the end, for each measured core, sources are ranked by how much of
+ * that core's lost work fell in periods when they fired there.
+ */
+#include "ftq.h"
+
+#define IRQ_NAMELEN 48
+
+/* one read of every source on every cpu; filled in by irq_snapshot() */
+struct irqsnap {
+	int nsrc, ncpu;
+	int maxsrc, maxcpu;
+	/* cpu number of each column */
+	int *cpu;
+	char (*name)[IRQ_NAMELEN];
+	/* nsrc rows of ncpu */
+	unsigned long long *count;
+};
+
+/* a source fired delta times on cpu in the period ending at tick */
+struct irqevent {
+	ticks tick;
+	int period;
+	int src;
+	int cpu;
+	unsigned long long delta;
+};
+
+/* what irqtrace_rank needs to know about each measuring thread */
+struct irqthread {
+	int core;
+	const struct sample *samples;
+	size_t numsamples;
+	unsigned long long max_count;
+	/* FWQ: counts are ticks taken, and max_count the least of them */
+	int elapsed;
+};
+
+/* irqtrace.c */
+int irqtrace_start(unsigned long period_msec, int core);
+void irqtrace_stop(void);
+int irqtrace_write(const char *name, ticks epoch, double ticksperns);
+int irqtrace_rank(const char *name, const struct irqthread *threads,
+                  int numthreads);
@@ -2,6 +2,8 @@
 #define _GNU_SOURCE
 
 #include "ftq.h"
+#include "pmu.h"
+#include "irqtrace.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -10,12 +12,27 @@
 #include <time.h>
 #include <errno.h>
 #include <sched.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 /* what clock do we use for the OS timer? */
 #define TICKCLOCK CLOCK_MONOTONIC_RAW
 
+/* where compute_ticksperns got it, for the header */
+static char tpns_source[160];
+
 /* return current time in ns as a 'tick' */
 ticks nsec_ticks()
 {
@@ -69,6 +86,9 @@ void osinfo(FILE *f, int core)
 			continue;
 		fprintf(f, "# %s", buf);
 	}
+	fclose(cpu);
+	if (tpns_source[0])
+		fprintf(f, "# ticks per ns from %s\n", tpns_source);
 }
 
 int threadinit(int numthreads)
@@ -97,24 +117,288 @@ int wireme(int core)
 	return 0;
 }
 
-double compute_ticksperns(void)
+/*
+ * leaf 0x15 is exact, TSC = crystal * ebx / eax; 0x16 is the nominal
+ * base frequency, which is often but not always the TSC's, so *nominal
+ * says to check it
+ */
+static double tpns_cpuid(int *nominal)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	unsigned int a, b, c, d;
+
+	*nominal = 0;
+	if (__get_cpuid_max(0, NULL) < 0x15)
+		return 0;
+	__cpuid_count(0x15, 0, a, b, c, d);
+	if (a && b && c) {
+		snprintf(tpns_source, sizeof(tpns_source), "cpuid 0x15");
+		return (double)c * b / a / 1e9;
+	}
+	if (__get_cpuid_max(0, NULL) < 0x16)
+		return 0;
+	__cpuid_count(0x16, 0, a, b, c, d);
+	if (a) {
+		*nominal = 1;
+		return a / 1000.0;
+	}
+#endif
+	return 0;
+}
+
+/* what the kernel worked out at boot: sysfs if it exports it, or the log */
+static double tpns_kernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	char buf[1024], *p;
+	double mhz = 0, refined = 0, v;
+	unsigned long khz;
+	ssize_t n;
+	FILE *f;
+	int fd;
+
+	f = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+	if (f) {
+		n = fscanf(f, "%lu", &khz);
+		fclose(f);
+		if (n == 1 && khz) {
+			snprintf(tpns_source, sizeof(tpns_source), "tsc_freq_khz");
+			return khz / 1e6;
+		}
+	}
+	/* a record per read; nonblocking, so we stop at the end */
+	fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		return 0;
+	while ((n = read(fd, buf, sizeof(buf) - 1)) > 0 || (n < 0 && errno == EPIPE)) {
+		if (n < 0)
+			continue;
+		buf[n] = 0;
+		p = strchr(buf, ';');
+		if (!p)
+			continue;
+		if (sscanf(p, ";tsc: Refined TSC clocksource calibration: %lf MHz",
+		           &v) == 1)
+			refined = v;
+		else if (sscanf(p, ";tsc: Detected %lf MHz TSC", &v) == 1)
+			mhz = v;
+		else if (!mhz && sscanf(p, ";tsc: Detected %lf MHz processor",
+		                        &v) == 1)
+			mhz = v;
+	}
+	close(fd);
+	if (refined)
+		mhz = refined;
+	if (mhz) {
+		snprintf(tpns_source, sizeof(tpns_source), "kernel log");
+		return mhz / 1000;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Fit a line to (ns, ticks) pairs a few msec apart. Each pair is the
+ * tightest of a few tries, with the tick read between two clock reads.
+ * The slope's 95% bound goes in the source, in parts per million.
+ */
+static double tpns_regress(void)
+{
+	enum { NPOINT = 25, NTRY = 8 };
+	struct timespec nap = {0, 4000000};
+	double x[NPOINT], y[NPOINT], mx = 0, my = 0, sxx = 0, sxy = 0, ss = 0;
+	double slope, r, se;
+	ticks t0, t1, tk, width, best, x0 = 0, y0 = 0;
+	int i, j;
+
+	for (i = 0; i < NPOINT; i++) {
+		best = ~0ULL;
+		for (j = 0; j < NTRY; j++) {
+			t0 = nsec_ticks();
+			tk = getticks();
+			t1 = nsec_ticks();
+			width = t1 - t0;
+			if (width < best) {
+				best = width;
+				if (!i && !j) {
+					x0 = t0;
+					y0 = tk;
+				}
+				x[i] = t0 + width / 2.0 - x0;
+				y[i] = tk - y0;
+			}
+		}
+		mx += x[i];
+		my += y[i];
+		nanosleep(&nap, NULL);
+	}
+	mx /= NPOINT;
+	my /= NPOINT;
+	for (i = 0; i < NPOINT; i++) {
+		sxx += (x[i] - mx) * (x[i] - mx);
+		sxy += (x[i] - mx) * (y[i] - my);
+	}
+	slope = sxy / sxx;
+	for (i = 0; i < NPOINT; i++) {
+		r = y[i] - my - slope * (x[i] - mx);
+		ss += r * r;
+	}
+	se = sqrt(ss / (NPOINT - 2) / sxx);
+	snprintf(tpns_source, sizeof(tpns_source),
+	         "regression, %d points over %.0f msec, +-%.2g ppm",
+	         NPOINT, x[NPOINT - 1] / 1e6, 2 * se / slope * 1e6);
+	return slope;
+}
+
+/*
+ * The per-machine cache: lines of "key<tab>ticksperns<tab>source", one
+ * per host and cpu model, and at most TPNS_CACHE_MAX of them.
+ */
+#define TPNS_CACHE_MAX 64
+/* how far cpuid 0x16 may be from a regression and still be believed */
+#define TPNS_NOMINAL_PPM 1000
+
+static void tpns_cachename(char *name, size_t size)
+{
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+	if (dir)
+		snprintf(name, size, "%s/ftq-ticksperns", dir);
+	else if (home)
+		snprintf(name, size, "%s/.cache/ftq-ticksperns", home);
+	else
+		name[0] = 0;
+}
+
+/* host, cpu model and microcode: if any of them change, measure again */
+static void tpns_cachekey(char *key, size_t size)
+{
+	char buf[512], model[256] = "", ucode[64] = "", host[128] = "";
+	FILE *f;
+
+	gethostname(host, sizeof(host) - 1);
+	f = fopen("/proc/cpuinfo", "r");
+	if (f) {
+		while (fgets(buf, sizeof(buf), f)) {
+			if (!model[0])
+				sscanf(buf, "model name : %255[^\n]", model);
+			if (!ucode[0])
+				sscanf(buf, "microcode : %63s", ucode);
+			if (!strcmp(buf, "\n"))
+				break;
+		}
+		fclose(f);
+	}
+	snprintf(key, size, "%s|%s|%s", host, model, ucode);
+}
+
+/*
+ * Put key's line in the cache in place of any for the same host and
+ * model, whatever their microcode, keeping the newest lines; written
+ * to the side and renamed, so a reader never sees half of it.
+ */
+static void tpns_cachesave(const char *name, const char *key, double convert)
 {
-	ticks tickstart, tickend;
-	unsigned long long timestart, timeend, ns;
-	double convert;
-	ticks el;
-
-	timestart = nsec_ticks();
-	tickstart = getticks();
-	sleep(2);
-	tickend = getticks();
-	timeend = nsec_ticks();
-	ns = timeend - timestart;
-	el = tickend - tickstart;
-	convert = (1.0 * el) / ns;
+	char tmp[4200], line[1024], *lines[TPNS_CACHE_MAX];
+	size_t model = strrchr(key, '|') - key + 1;
+	int n = 0, i;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strchr(line, '\t') || !strncmp(line, key, model))
+				continue;
+			if (n == TPNS_CACHE_MAX - 1) {
+				free(lines[0]);
+				memmove(lines, lines + 1, --n * sizeof(lines[0]));
+			}
+			lines[n++] = strdup(line);
+		}
+		fclose(f);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+	f = fopen(tmp, "w");
+	if (f) {
+		for (i = 0; i < n; i++)
+			if (lines[i])
+				fputs(lines[i], f);
+		fprintf(f, "%s\t%.9f\t%s\n", key, convert, tpns_source);
+		if (fclose(f) || rename(tmp, name))
+			unlink(tmp);
+	}
+	for (i = 0; i < n; i++)
+		free(lines[i]);
+}
+
+/* remember convert for next time, if there is a cache */
+static double tpns_cache(const char *name, const char *key, double convert)
+{
+	char dir[4096];
+
+	if (!name[0])
+		return convert;
+	/* ~/.cache may not be there yet */
+	if (!getenv("XDG_CACHE_HOME") && getenv("HOME")) {
+		snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+		mkdir(dir, 0755);
+	}
+	tpns_cachesave(name, key, convert);
 	return convert;
 }
 
+double compute_ticksperns(void)
+{
+	char name[4096], key[512], line[1024], src[160];
+	double convert = 0, measured;
+	int nominal = 0;
+	FILE *f;
+
+	tpns_cachename(name, sizeof(name));
+	tpns_cachekey(key, sizeof(key));
+	f = name[0] ? fopen(name, "r") : NULL;
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			char *tab = strchr(line, '\t');
+
+			if (!tab || tab - line != strlen(key)
+			    || strncmp(line, key, tab - line))
+				continue;
+			if (sscanf(tab, "\t%lf\t%159[^\n]", &convert, src) == 2
+			    && convert > 0) {
+				snprintf(tpns_source, sizeof(tpns_source),
+				         "%.140s (cached)", src);
+				break;
+			}
+			convert = 0;
+		}
+		fclose(f);
+		if (convert > 0)
+			return convert;
+	}
+
+	convert = tpns_cpuid(&nominal);
+	if (nominal) {
+		/* not exact; the kernel's number, or one we check */
+		measured = tpns_kernel();
+		if (measured > 0)
+			return tpns_cache(name, key, measured);
+		measured = tpns_regress();
+		if (fabs(convert / measured - 1) * 1e6 <= TPNS_NOMINAL_PPM) {
+			snprintf(src, sizeof(src), "%s", tpns_source);
+			snprintf(tpns_source, sizeof(tpns_source),
+			         "cpuid 0x16, checked by %.120s", src);
+		} else {
+			convert = measured;
+		}
+	}
+	if (convert <= 0)
+		convert = tpns_kernel();
+	if (convert <= 0)
+		convert = tpns_regress();
+	return tpns_cache(name, key, convert);
+}
+
 int get_num_cores(void)
 {
 	return sysconf(_SC_NPROCESSORS_ONLN);
@@ -122,7 +406,107 @@ int get_num_cores(void)
 
 int get_coreid(void)
 {
-	return -1;
+	return sched_getcpu();
+}
+
+/* "2-7,12,14" into cpus, in order; the count, or -1 if it is not a list */
+static int parse_cpus(const char *s, int *cpus, int max)
+{
+	long lo, hi, c;
+	char *end;
+	int i, n = 0;
+
+	while (*s && *s != '\n') {
+		lo = hi = strtol(s, &end, 10);
+		if (end == s || lo < 0)
+			return -1;
+		s = end;
+		if (*s == '-') {
+			hi = strtol(s + 1, &end, 10);
+			if (end == s + 1 || hi < lo)
+				return -1;
+			s = end;
+		}
+		for (c = lo; c <= hi; c++) {
+			if (n == max || c >= CPU_LIST_MAX)
+				return -1;
+			for (i = 0; i < n; i++)
+				if (cpus[i] == c)
+					return -1;
+			cpus[n++] = c;
+		}
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -1;
+	}
+	return n;
+}
+
+static int cpu_in_file(const char *name, int cpu)
+{
+	int cpus[CPU_LIST_MAX];
+	char buf[4096];
+	FILE *f;
+	int i, n;
+
+	f = fopen(name, "r");
+	if (!f)
+		return 0;
+	n = fgets(buf, sizeof(buf), f) ? parse_cpus(buf, cpus, CPU_LIST_MAX)
+	                               : -1;
+	fclose(f);
+	for (i = 0; i < n; i++)
+		if (cpus[i] == cpu)
+			return 1;
+	return 0;
+}
+
+/*
+ * The kernel keeps our affinity mask inside the cgroup's cpuset, so
+ * checking against it covers both.
+ */
+int cpu_list(const char *list, int *cpus, int max)
+{
+	cpu_set_t *set = CPU_ALLOC(CPU_LIST_MAX);
+	size_t size = CPU_ALLOC_SIZE(CPU_LIST_MAX);
+	int i, n = 0;
+
+	assert(set);
+	CPU_ZERO_S(size, set);
+	if (sched_getaffinity(0, size, set) < 0) {
+		perror("sched_getaffinity");
+		CPU_FREE(set);
+		return -1;
+	}
+	if (list) {
+		n = parse_cpus(list, cpus, max);
+		if (n <= 0)
+			fprintf(stderr, "bad cpu list \"%s\"\n", list);
+		for (i = 0; i < n; i++)
+			if (!CPU_ISSET_S(cpus[i], size, set)) {
+				fprintf(stderr, "cpu %d is not in our affinity mask "
+				        "or cpuset\n", cpus[i]);
+				n = -1;
+			}
+	} else {
+		for (i = 0; i < CPU_LIST_MAX && n < max; i++)
+			if (CPU_ISSET_S(i, size, set))
+				cpus[n++] = i;
+	}
+	CPU_FREE(set);
+	return n > 0 ? n : -1;
+}
+
+int cpu_isolation(int cpu)
+{
+	int flags = 0;
+
+	if (cpu_in_file("/sys/devices/system/cpu/isolated", cpu))
+		flags |= CORE_ISOLCPUS;
+	if (cpu_in_file("/sys/devices/system/cpu/nohz_full", cpu))
+		flags |= CORE_NOHZ_FULL;
+	return flags;
 }
 
 void set_sched_realtime(void)
@@ -139,20 +523,424 @@ void set_sched_realtime(void)
 	}
 }
 
-struct sample *allocate_samples(size_t samples_size)
+/*
+ * Called by the thread that will write the samples, after it is wired,
+ * so that first touch puts them on its node. Try for huge pages, largest
+ * first, so sample stores don't take TLB misses; hugetlb reserves pages
+ * at mmap time, so a failure here is a clean fallback.
+ */
+static const struct {
+	int flags;
+	size_t pagesize;
+	const char *kind;
+} hugepages[] = {
+	{MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), 1UL << 30, "hugetlb"},
+	{MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), 1UL << 21, "hugetlb"},
+};
+
+int allocate_samples(struct sample_region *r, size_t samples_size)
 {
-	struct sample *samples;
+	void *p = MAP_FAILED;
+	size_t len;
+	int i, node;
 
-	samples = mmap(0, samples_size, PROT_READ | PROT_WRITE,
-	               MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE,
-	               -1, 0);
-	if (samples != MAP_FAILED) {
-		if (mlock(samples, samples_size) < 0)
-			perror("Failed to mlock");
-	} else {
+	memset(r, 0, sizeof(*r));
+	r->node = -1;
+	for (i = 0; i < sizeof(hugepages) / sizeof(hugepages[0]); i++) {
+		if (samples_size < hugepages[i].pagesize)
+			continue;
+		len = (samples_size + hugepages[i].pagesize - 1)
+		      & ~(hugepages[i].pagesize - 1);
+		p = mmap(0, len, PROT_READ | PROT_WRITE,
+		         MAP_ANONYMOUS | MAP_PRIVATE | hugepages[i].flags, -1, 0);
+		if (p != MAP_FAILED) {
+			r->pagesize = hugepages[i].pagesize;
+			r->kind = hugepages[i].kind;
+			break;
+		}
+	}
+	if (p == MAP_FAILED) {
+		len = samples_size;
+		r->pagesize = sysconf(_SC_PAGESIZE);
+		p = mmap(0, len, PROT_READ | PROT_WRITE,
+		         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (p != MAP_FAILED) {
+			/* no promises; khugepaged may or may not oblige */
+			if (len >= hugepages[1].pagesize
+			    && !madvise(p, len, MADV_HUGEPAGE))
+				r->kind = "thp-advised";
+			else
+				r->kind = "base";
+		}
+	}
+	if (p == MAP_FAILED) {
 		perror("Failed to mmap, will just malloc");
-		samples = malloc(samples_size);
-		assert(samples);
+		p = malloc(samples_size);
+		if (!p)
+			return -1;
+		len = samples_size;
+		r->kind = "malloc";
+	}
+
+	/* first touch, from here. */
+	memset(p, 0, len);
+	if (mlock(p, len) < 0)
+		perror("Failed to mlock");
+	if (!syscall(SYS_get_mempolicy, &node, NULL, 0, p,
+	             MPOL_F_NODE | MPOL_F_ADDR))
+		r->node = node;
+	r->samples = p;
+	r->size = len;
+	return 0;
+}
+
+/*
+ * -m: the samples in a file, mapped shared, so that they are in the page
+ * cache as soon as they are stored and outlive a kill. The file must be
+ * on tmpfs: on disk, writeback would clean its pages as the run goes,
+ * and the next store to each would take a fault in the loop. The blocks
+ * are allocated now, so that a full filesystem fails here and not with a
+ * SIGBUS in the middle of the run, and every page is written once, from
+ * here, so that the run takes no faults for them.
+ */
+int map_samples_file(struct sample_region *r, const char *name, size_t size)
+{
+	const char *slash = strrchr(name, '/');
+	char dir[4096];
+	struct statfs fs;
+	void *p;
+	int fd, node, err;
+
+	memset(r, 0, sizeof(*r));
+	r->node = -1;
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - name + 1) : 1,
+	         slash ? name : ".");
+	if (statfs(dir, &fs) < 0) {
+		fprintf(stderr, "%s: %m\n", dir);
+		return -1;
+	}
+	if (fs.f_type != TMPFS_MAGIC && fs.f_type != RAMFS_MAGIC) {
+		fprintf(stderr, "%s: not on tmpfs; -m needs its files in memory "
+		        "(e.g. -o /dev/shm/run)\n", name);
+		return -1;
+	}
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %m\n", name);
+		return -1;
 	}
-	return samples;
+	err = posix_fallocate(fd, 0, size);
+	if (err) {
+		fprintf(stderr, "%s: can not allocate %zu bytes: %s\n", name,
+		        size, strerror(err));
+		close(fd);
+		return -1;
+	}
+	p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %m\n", name);
+		return -1;
+	}
+
+	/* first touch, and the first write, from here. */
+	memset(p, 0, size);
+	if (mlock(p, size) < 0)
+		perror("Failed to mlock");
+	if (!syscall(SYS_get_mempolicy, &node, NULL, 0, p,
+	             MPOL_F_NODE | MPOL_F_ADDR))
+		r->node = node;
+	r->samples = p;
+	r->size = size;
+	r->pagesize = sysconf(_SC_PAGESIZE);
+	r->kind = "file";
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+	int exclude_user, exclude_kernel;
+} pmu_events[] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0, 0},
+	{"cycles-user", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0, 1},
+	{"cycles-kernel", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1, 0},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0, 0},
+	{"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES, 0, 0},
+	{"llc-refs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, 0, 0},
+	{"llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0, 0},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0, 0},
+};
+
+static void pmu_usage(void)
+{
+	int i;
+
+	fprintf(stderr, "pmu events:");
+	for (i = 0; i < sizeof(pmu_events) / sizeof(pmu_events[0]); i++)
+		fprintf(stderr, " %s", pmu_events[i].name);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Open the counters for this thread, pinned, and map each one's control
+ * page so we can find its rdpmc index. Any failure is fatal to the whole
+ * set: half a set of columns is not what was asked for.
+ */
+int pmu_open(struct pmu *pmu, const char *events)
+{
+#ifdef HAVE_RDPMC
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pg;
+	char *list, *name, *save;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int i, fd;
+
+	memset(pmu, 0, sizeof(*pmu));
+	list = strdup(events);
+	assert(list);
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (pmu->n == PMU_MAX) {
+			fprintf(stderr, "pmu: at most %d events\n", PMU_MAX);
+			goto bad;
+		}
+		for (i = 0; i < sizeof(pmu_events) / sizeof(pmu_events[0]); i++)
+			if (!strcmp(name, pmu_events[i].name))
+				break;
+		if (i == sizeof(pmu_events) / sizeof(pmu_events[0])) {
+			fprintf(stderr, "pmu: no event %s\n", name);
+			pmu_usage();
+			goto bad;
+		}
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pmu_events[i].type;
+		attr.config = pmu_events[i].config;
+		attr.exclude_user = pmu_events[i].exclude_user;
+		attr.exclude_kernel = pmu_events[i].exclude_kernel;
+		attr.exclude_hv = 1;
+		attr.pinned = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd < 0) {
+			fprintf(stderr, "pmu: %s: perf_event_open: %m\n", name);
+			goto bad;
+		}
+		pmu->fd[pmu->n] = fd;
+		pmu->name[pmu->n] = pmu_events[i].name;
+		pmu->n++;
+		pg = mmap(0, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+		if (pg == MAP_FAILED) {
+			fprintf(stderr, "pmu: %s: mmap: %m\n", name);
+			goto bad;
+		}
+		pmu->page[pmu->n - 1] = pg;
+		if (!pg->cap_user_rdpmc || !pg->index) {
+			fprintf(stderr, "pmu: %s: rdpmc not allowed; "
+			        "see /sys/bus/event_source/devices/cpu/rdpmc\n",
+			        name);
+			goto bad;
+		}
+	}
+	free(list);
+	return pmu->n;
+bad:
+	free(list);
+	pmu_close(pmu);
+	return -1;
+#else
+	fprintf(stderr, "pmu: no rdpmc support for this architecture\n");
+	return -1;
+#endif
+}
+
+void pmu_close(struct pmu *pmu)
+{
+	int i;
+
+	for (i = 0; i < pmu->n; i++) {
+		if (pmu->page[i])
+			munmap(pmu->page[i], sysconf(_SC_PAGESIZE));
+		close(pmu->fd[i]);
+	}
+	pmu->n = 0;
+}
+
+/* from sysfs for the core we are on, which may differ on hybrid parts */
+size_t cache_size(int level)
+{
+	char name[128], type[32], unit;
+	int i, l, cpu = sched_getcpu();
+	unsigned long size;
+	FILE *f;
+
+	for (i = 0; cpu >= 0; i++) {
+		snprintf(name, sizeof(name),
+		         "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+		f = fopen(name, "r");
+		if (!f)
+			break;
+		l = 0;
+		if (fscanf(f, "%d", &l) != 1)
+			l = 0;
+		fclose(f);
+		if (l != level)
+			continue;
+		snprintf(name, sizeof(name),
+		         "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, i);
+		f = fopen(name, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%31s", type) != 1)
+			type[0] = 0;
+		fclose(f);
+		if (!strcmp(type, "Instruction"))
+			continue;
+		snprintf(name, sizeof(name),
+		         "/sys/devices/system/cpu/cpu%d/cache/index%d/size", cpu, i);
+		f = fopen(name, "r");
+		if (!f)
+			continue;
+		unit = 0;
+		if (fscanf(f, "%lu%c", &size, &unit) < 1)
+			size = 0;
+		fclose(f);
+		if (unit == 'K')
+			size <<= 10;
+		else if (unit == 'M')
+			size <<= 20;
+		return size;
+	}
+	switch (level) {
+	case 1:
+		return sysconf(_SC_LEVEL1_DCACHE_SIZE) > 0
+			? sysconf(_SC_LEVEL1_DCACHE_SIZE) : 0;
+	case 2:
+		return sysconf(_SC_LEVEL2_CACHE_SIZE) > 0
+			? sysconf(_SC_LEVEL2_CACHE_SIZE) : 0;
+	case 3:
+		return sysconf(_SC_LEVEL3_CACHE_SIZE) > 0
+			? sysconf(_SC_LEVEL3_CACHE_SIZE) : 0;
+	}
+	return 0;
+}
+
+/*
+ * One of /proc/interrupts or /proc/softirqs: a line of CPUn headers,
+ * then "key: count count ... description" per source. Numeric keys are
+ * named for the last word of their description, e.g. "24:eth0".
+ *
+ * The first file read sets the columns. The other's columns go to the
+ * same cpus by number: /proc/interrupts has only the online cpus, and
+ * /proc/softirqs every possible one. A cpu a file lacks reads 0.
+ */
+static int irq_parse(const char *file, struct irqsnap *snap, const char *prefix)
+{
+	char *line = NULL, *p, *end, *key, *desc;
+	size_t len = 0;
+	int ncol = 0, maxcol = 0, *col = NULL, first = !snap->ncpu;
+	int c, j, r;
+	unsigned long long v;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		return -1;
+	if (getline(&line, &len, f) < 0)
+		goto bad;
+	for (p = line; (p = strstr(p, "CPU")); p = end) {
+		if (ncol == maxcol) {
+			maxcol = maxcol ? maxcol * 2 : 64;
+			col = realloc(col, maxcol * sizeof(*col));
+			assert(col);
+		}
+		c = strtol(p + 3, &end, 10);
+		if (first) {
+			if (ncol == snap->maxcpu) {
+				snap->maxcpu = snap->maxcpu ? snap->maxcpu * 2 : 64;
+				snap->cpu = realloc(snap->cpu,
+				                    snap->maxcpu * sizeof(int));
+				snap->count = realloc(snap->count, snap->maxsrc
+				                      * snap->maxcpu
+				                      * sizeof(*snap->count));
+				assert(snap->cpu && (snap->count || !snap->maxsrc));
+			}
+			snap->cpu[ncol] = c;
+			col[ncol] = ncol;
+			ncol++;
+			continue;
+		}
+		/* this file's column ncol is the snapshot's column col[ncol] */
+		for (j = 0; j < snap->ncpu && snap->cpu[j] != c; j++)
+			;
+		col[ncol++] = j < snap->ncpu ? j : -1;
+	}
+	if (first)
+		snap->ncpu = ncol;
+
+	while (getline(&line, &len, f) >= 0) {
+		for (key = line; *key == ' '; key++)
+			;
+		p = strchr(key, ':');
+		if (!p)
+			continue;
+		*p++ = 0;
+		if (snap->nsrc == snap->maxsrc) {
+			snap->maxsrc = snap->maxsrc ? snap->maxsrc * 2 : 256;
+			snap->name = realloc(snap->name,
+			                     snap->maxsrc * sizeof(*snap->name));
+			snap->count = realloc(snap->count, snap->maxsrc * snap->maxcpu
+			                      * sizeof(*snap->count));
+			assert(snap->name && snap->count);
+		}
+		r = snap->nsrc++;
+		for (c = 0; c < snap->ncpu; c++)
+			snap->count[r * snap->ncpu + c] = 0;
+		/* ERR and MIS have one number, not one per cpu */
+		for (j = 0; j < ncol; j++) {
+			v = strtoull(p, &end, 10);
+			if (end == p)
+				break;
+			p = end;
+			if (col[j] >= 0)
+				snap->count[r * snap->ncpu + col[j]] = v;
+		}
+		desc = NULL;
+		if (*key >= '0' && *key <= '9') {
+			end = p + strlen(p);
+			while (end > p && (end[-1] == '\n' || end[-1] == ' '))
+				*--end = 0;
+			desc = strrchr(p, ' ');
+			desc = desc ? desc + 1 : NULL;
+		}
+		snprintf(snap->name[r], IRQ_NAMELEN, "%s%s%s%s", prefix, key,
+		         desc ? ":" : "", desc ? desc : "");
+	}
+	free(col);
+	free(line);
+	fclose(f);
+	return 0;
+bad:
+	free(col);
+	free(line);
+	fclose(f);
+	return -1;
+}
+
+int irq_snapshot(struct irqsnap *snap)
+{
+	static int warned;
+
+	snap->nsrc = 0;
+	snap->ncpu = 0;
+	if (irq_parse("/proc/interrupts", snap, "") < 0)
+		return -1;
+	/* old kernels don't have it; interrupts alone are still useful */
+	if (irq_parse("/proc/softirqs", snap, "softirq:") < 0 && !warned) {
+		fprintf(stderr, "/proc/softirqs: can not read it; softirqs "
+		        "are left out of the ranking\n");
+		warned = 1;
+	}
+	return 0;
 }
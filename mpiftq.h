@@ -24,10 +24,6 @@ struct sample {
 	unsigned long long *count;
 };
 
-/* ftqcore.c */
-unsigned long main_loops(struct sample *samples, size_t numsamples,
-                         ticks tickinterval, int offset);
-
 /* must be provided by OS code */
 /* Sorry, Plan 9; don't know how to manage FILE yet */
 ticks nsec_ticks(void);
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Per-sample hardware counters. The OS code opens them (pmu_open, in
+ * linux.c etc.) for the calling thread; the loops in ftqcore.c read them
+ * with rdpmc, which costs a few dozen cycles and no system call.
+ *
+ * Pinning and wiring are not enough to read a counter raw: when the
+ * thread is switched out, or the events are rotated, perf may put the
+ * event back on another counter, or on none, and it keeps the rest of
+ * the count in the mmap page. So every read is the one perf documents
+ * for the page: under its lock, the counter at index - 1 plus offset.
+ * An index of 0 means the event is not on a counter just now; that
+ * sample, and the one after it, have no delta (PMU_NONE).
+ */
+#include "ftq.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
+#define PMU_MAX 8
+/* the longest line with PMU columns, and the overrun ones */
+#define PMU_MAXLINE (96 + 21 * PMU_MAX)
+/* a sample's delta when the counter could not be read; -1 in text */
+#define PMU_NONE (~0ULL)
+
+struct pmu {
+	int n;
+	int fd[PMU_MAX];
+	/* perf's mmap page for each; see pmu_read */
+	void *page[PMU_MAX];
+	const char *name[PMU_MAX];
+	/* what a read of all n costs, measured at open time */
+	double overhead;
+};
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_RDPMC
+static __inline__ unsigned long long rdpmc(unsigned int idx)
+{
+	unsigned a, d;
+
+	asm volatile ("rdpmc":"=a" (a), "=d"(d):"c"(idx));
+	return ((unsigned long long) a) | (((unsigned long long) d) << 32);
+}
+#else
+static __inline__ unsigned long long rdpmc(unsigned int idx)
+{
+	return 0;
+}
+#endif
+
+#if defined(HAVE_RDPMC) && defined(__linux__)
+/* counter i's count so far, or -1 if it is not on a counter */
+static __inline__ int pmu_read(const struct pmu *pmu, int i,
+                               unsigned long long *v)
+{
+	volatile struct perf_event_mmap_page *pg = pmu->page[i];
+	unsigned int seq, idx, width;
+	long long count, pmc;
+
+	do {
+		seq = pg->lock;
+		__asm__ volatile("" ::: "memory");
+		idx = pg->index;
+		count = pg->offset;
+		if (idx) {
+			width = pg->pmc_width;
+			/* sign extend, as perf's offset expects */
+			pmc = rdpmc(idx - 1);
+			pmc <<= 64 - width;
+			pmc >>= 64 - width;
+			count += pmc;
+		}
+		__asm__ volatile("" ::: "memory");
+	} while (pg->lock != seq);
+	if (!idx)
+		return -1;
+	*v = count;
+	return 0;
+}
+#else
+static __inline__ int pmu_read(const struct pmu *pmu, int i,
+                               unsigned long long *v)
+{
+	return -1;
+}
+#endif
@@ -1,11 +1,17 @@
 #!/usr/bin/env perl
 
 ## FTQ experiment generation
+##
+## Deprecated: this is now a wrapper around ftq's sweep mode (ftq -A),
+## kept for one release.  Run ftq -A directly; see "Sweeps" in README.txt.
 
 print "=================================\n";
 print "Fixed Time Quantum Microbenchmark\n";
 print "=================================\n\n";
 
+print STDERR "NOTE: run_experiment.pl is deprecated and will be removed in the\n";
+print STDERR "next release.  It now runs: ftq -A <archive> -n <samples> -t 1,<cores>\n\n";
+
 print "Experiment name (eg: Argonne BGL): ";
 chomp($exper = <>);
 
@@ -52,7 +58,7 @@ if (-e $dirname.".tar.gz") {
 
 print "Performing experiment in directory \"$dirname\".\n";
 
-mkdir($dirname) || die "Unable to create experiment directory."; 
+mkdir($dirname) || die "Unable to create experiment directory.";
 
 chdir($dirname) || die "Unable to change to experiment directory.";
 
@@ -67,15 +73,16 @@ print OUTFILE "CORES: $ncores\n";
 print OUTFILE "SAMPLES: $nsamp\n";
 close(OUTFILE);
 
-print "Running single threaded FTQ...";
-
-system("../ftq63 -n $nsamp -o singlethread");
-
-print "done.\n";
+## single threaded, then one thread per core, as one sweep
+$threads = $ncores > 1 ? "1,$ncores" : "1";
 
-print "Running multithreaded FTQ...";
+print "Running FTQ with $threads threads...";
 
-system("../t_ftq63 -t $ncores -n $nsamp -o multithreaded");
+if (system("../ftq.linux -A experiment.arc -n $nsamp -t $threads") != 0) {
+  print "failed.\n";
+  chdir("..");
+  exit(1);
+}
 
 print "done.\n";
 
@@ -86,4 +93,5 @@ system("gzip $dirname.tar");
 system("rm -Rf $dirname");
 
 print "\nAll done.\n";
-print "Experiment data is in $dirname.tar.gz\n\n";
+print "Experiment data is in $dirname.tar.gz; ftqdump -w experiment.arc\n";
+print "writes each run's threads out as text.\n\n";
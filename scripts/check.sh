@@ -0,0 +1,68 @@
+#!/bin/sh
+# Smoke test for make check: short runs of ftq.linux in text, -b, -z and
+# -m, a run killed under -m, and -M, read back with ftqdump, ftqcmp and
+# ftqtop.  Run from the top of the tree, after make.
+
+N=2000
+T=${TMPDIR:-/tmp}/ftqcheck.$$
+# -m needs tmpfs
+M=/dev/shm/ftqcheck.$$
+fail=0
+
+ok() {
+	echo "ok   $1"
+}
+
+bad() {
+	echo "FAIL $1"
+	fail=1
+}
+
+# sample lines, not the # header, in a text file
+samples() {
+	grep -vc '^#' "$1"
+}
+
+mkdir -p $T || exit 1
+trap 'rm -rf $T $M*' 0
+
+./ftq.linux -n $N -o $T/txt >/dev/null 2>&1
+[ "`samples $T/txt_0.dat`" = $N ] && ok "text" || bad "text"
+
+# a binary file, written back as text, reads the same as the binary
+for z in "" -z; do
+	./ftq.linux -n $N -b $z -o $T/bin$z >/dev/null 2>&1 &&
+	./ftqdump -w $T/bin${z}_0.bin &&
+	[ "`samples $T/bin${z}_0.dat`" = $N ] &&
+	grep -q '^# Total count' $T/bin${z}_0.dat &&
+	./ftqcmp $T/bin${z}_0.bin -- $T/bin${z}_0.dat >/dev/null &&
+	ok "-b $z round trip" || bad "-b $z round trip"
+done
+
+if [ -d /dev/shm ]; then
+	./ftq.linux -n $N -m -o $M >/dev/null 2>&1 &&
+	./ftqdump -w ${M}_0.bin &&
+	[ "`samples ${M}_0.dat`" = $N ] &&
+	! ./ftqdump -i ${M}_0.bin | grep -q unfinished &&
+	ok "-m" || bad "-m"
+
+	# killed part way: the file has what was stored, and says so
+	./ftq.linux -n 10000000 -m -o ${M}k >/dev/null 2>&1 &
+	sleep 1
+	kill -9 $!
+	wait $! 2>/dev/null
+	./ftqdump -i ${M}k_0.bin | grep -q unfinished &&
+	./ftqdump -w ${M}k_0.bin &&
+	[ "`samples ${M}k_0.dat`" -gt 0 ] &&
+	ok "-m killed" || bad "-m killed"
+else
+	echo "skip -m: no /dev/shm"
+fi
+
+./ftq.linux -n 20000 -M $T/tel -o $T/tel >/dev/null 2>&1 &
+sleep 1
+./ftqtop -m $T/tel | grep -q '^ftq_samples_total' &&
+ok "-M" || bad "-M"
+wait
+
+exit $fail
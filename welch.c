@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Welch PSD: window, FFT, average |X|^2 over overlapping segments.
+ *
+ * The FFT is a plain iterative radix-2 on split real/imaginary arrays,
+ * with per-stage contiguous twiddle tables so the butterfly loops are
+ * unit stride and the compiler vectorizes them. A real input of length
+ * N is done as a complex FFT of length N/2 and then untangled, which
+ * halves the work.
+ *
+ * Segments are independent, so they are spread across threads, each
+ * with its own scratch and accumulator, summed at the end.
+ *
+ * Keep this file OS-independent.
+ */
+#include "welch.h"
+
+#include <math.h>
+#include <pthread.h>
+
+struct plan {
+	size_t nfft;		/* real length */
+	size_t m;		/* complex length, nfft / 2 */
+	unsigned int *rev;	/* bit reversal of 0..m-1 */
+	double *twr, *twi;	/* stage with half-size h starts at h - 1 */
+	double *utr, *uti;	/* untangle twiddles, m + 1 of them */
+	double *win;
+	size_t window;
+	double winpow;		/* sum of win^2 */
+};
+
+static size_t pow2_at_least(size_t n)
+{
+	size_t p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static void make_window(double *w, size_t n, int type)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		double x = n > 1 ? (2 * M_PI * i) / (n - 1) : 0;
+
+		switch (type) {
+			case WELCH_HANN:
+				w[i] = 0.5 - 0.5 * cos(x);
+				break;
+			case WELCH_RECT:
+				w[i] = 1.0;
+				break;
+			case WELCH_HAMMING:
+			default:
+				w[i] = 0.54 - 0.46 * cos(x);
+				break;
+		}
+	}
+}
+
+static int plan_init(struct plan *p, size_t nfft, size_t window, int wintype)
+{
+	size_t m = nfft / 2, h, k, i;
+	unsigned int bits = 0, r, b;
+
+	memset(p, 0, sizeof(*p));
+	p->nfft = nfft;
+	p->m = m;
+	p->window = window;
+	p->rev = malloc(m * sizeof(*p->rev));
+	p->twr = malloc(m * sizeof(double));
+	p->twi = malloc(m * sizeof(double));
+	p->utr = malloc((m + 1) * sizeof(double));
+	p->uti = malloc((m + 1) * sizeof(double));
+	p->win = malloc(window * sizeof(double));
+	if (!p->rev || !p->twr || !p->twi || !p->utr || !p->uti || !p->win)
+		return -1;
+
+	while ((1UL << bits) < m)
+		bits++;
+	for (i = 0; i < m; i++) {
+		for (r = 0, b = 0; b < bits; b++)
+			if (i & (1UL << b))
+				r |= 1U << (bits - 1 - b);
+		p->rev[i] = r;
+	}
+	for (h = 1; h < m; h <<= 1)
+		for (k = 0; k < h; k++) {
+			p->twr[h - 1 + k] = cos(-M_PI * k / h);
+			p->twi[h - 1 + k] = sin(-M_PI * k / h);
+		}
+	for (k = 0; k <= m; k++) {
+		p->utr[k] = cos(-2 * M_PI * k / nfft);
+		p->uti[k] = sin(-2 * M_PI * k / nfft);
+	}
+
+	make_window(p->win, window, wintype);
+	p->winpow = 0;
+	for (i = 0; i < window; i++)
+		p->winpow += p->win[i] * p->win[i];
+	return 0;
+}
+
+static void plan_free(struct plan *p)
+{
+	free(p->rev);
+	free(p->twr);
+	free(p->twi);
+	free(p->utr);
+	free(p->uti);
+	free(p->win);
+}
+
+/* in place, input already in bit reversed order. */
+static void fft(const struct plan *p, double *restrict re, double *restrict im)
+{
+	size_t m = p->m, h, s, k;
+
+	/* the first two stages have trivial twiddles and short runs */
+	for (s = 0; s + 4 <= m; s += 4) {
+		double r0 = re[s] + re[s + 1], i0 = im[s] + im[s + 1];
+		double r1 = re[s] - re[s + 1], i1 = im[s] - im[s + 1];
+		double r2 = re[s + 2] + re[s + 3], i2 = im[s + 2] + im[s + 3];
+		double r3 = re[s + 2] - re[s + 3], i3 = im[s + 2] - im[s + 3];
+
+		/* x * -i for the odd one of the second pair */
+		re[s] = r0 + r2;
+		im[s] = i0 + i2;
+		re[s + 2] = r0 - r2;
+		im[s + 2] = i0 - i2;
+		re[s + 1] = r1 + i3;
+		im[s + 1] = i1 - r3;
+		re[s + 3] = r1 - i3;
+		im[s + 3] = i1 + r3;
+	}
+
+	for (h = 4; h < m; h <<= 1) {
+		const double *restrict wr = p->twr + h - 1;
+		const double *restrict wi = p->twi + h - 1;
+
+		for (s = 0; s < m; s += 2 * h) {
+			double *restrict ar = re + s, *restrict ai = im + s;
+			double *restrict br = re + s + h, *restrict bi = im + s + h;
+
+			for (k = 0; k < h; k++) {
+				double tr = wr[k] * br[k] - wi[k] * bi[k];
+				double ti = wr[k] * bi[k] + wi[k] * br[k];
+
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+		}
+	}
+}
+
+/*
+ * |X[k]|^2 for k = 0..nfft/2 of one windowed segment, added into acc.
+ * x has p->window points; the rest of the FFT input is zero.
+ */
+static void segment_power(const struct plan *p, const double *x, double mean,
+                          double *re, double *im, double *acc)
+{
+	size_t m = p->m, k, j;
+
+	/* pack even/odd reals into one complex sequence, bit reversed */
+	for (j = 0; j < m; j++) {
+		size_t e = 2 * j, o = 2 * j + 1;
+		unsigned int r = p->rev[j];
+
+		re[r] = e < p->window ? (x[e] - mean) * p->win[e] : 0;
+		im[r] = o < p->window ? (x[o] - mean) * p->win[o] : 0;
+	}
+	fft(p, re, im);
+
+	/* untangle: X[k] = E[k] + W^k O[k] */
+	for (k = 0; k <= m; k++) {
+		size_t a = k == m ? 0 : k, b = k == 0 ? 0 : m - k;
+		double er = 0.5 * (re[a] + re[b]), ei = 0.5 * (im[a] - im[b]);
+		double orr = 0.5 * (im[a] + im[b]), oi = -0.5 * (re[a] - re[b]);
+		double xr = er + p->utr[k] * orr - p->uti[k] * oi;
+		double xi = ei + p->utr[k] * oi + p->uti[k] * orr;
+
+		acc[k] += xr * xr + xi * xi;
+	}
+}
+
+struct worker {
+	pthread_t thread;
+	const struct plan *p;
+	const double *x;
+	double mean;
+	size_t step, first, stride, segments;
+	double *acc;
+};
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	double *re = malloc(w->p->m * sizeof(double));
+	double *im = malloc(w->p->m * sizeof(double));
+	size_t i;
+
+	assert(re && im);
+	for (i = w->first; i < w->segments; i += w->stride)
+		segment_power(w->p, w->x + i * w->step, w->mean, re, im, w->acc);
+	free(re);
+	free(im);
+	return NULL;
+}
+
+int welch(const double *x, size_t n, const struct welch_opts *opts,
+          struct welch_psd *out)
+{
+	size_t window, overlap, nfft, segments, nbins, i, k;
+	struct worker *w;
+	struct plan p;
+	double mean = 0;
+	int nthreads, t;
+
+	memset(out, 0, sizeof(*out));
+	window = opts->window ? opts->window : (size_t)(n / 4.5);
+	if (opts->overlap == WELCH_NO_OVERLAP)
+		overlap = 0;
+	else
+		overlap = opts->overlap ? opts->overlap : window / 2;
+	nfft = opts->nfft ? opts->nfft : pow2_at_least(window);
+	if (!opts->nfft && nfft < 256)
+		nfft = 256;
+	if (window < 2 || window > n || overlap >= window) {
+		fprintf(stderr, "welch: bad window %zu / overlap %zu for %zu samples\n",
+		        window, overlap, n);
+		return -1;
+	}
+	if (nfft < window || nfft < 8 || (nfft & (nfft - 1))) {
+		fprintf(stderr, "welch: nfft %zu must be a power of 2 >= 8 and "
+		        ">= window %zu\n", nfft, window);
+		return -1;
+	}
+	segments = (n - overlap) / (window - overlap);
+	nbins = nfft / 2 + 1;
+
+	if (opts->detrend == WELCH_DETREND_MEAN) {
+		for (i = 0; i < n; i++)
+			mean += x[i];
+		mean /= n;
+	}
+
+	if (plan_init(&p, nfft, window, opts->wintype) < 0) {
+		plan_free(&p);
+		fprintf(stderr, "welch: out of memory\n");
+		return -1;
+	}
+
+	nthreads = opts->nthreads > 0 ? opts->nthreads : 1;
+	if (nthreads > segments)
+		nthreads = segments;
+	w = calloc(nthreads, sizeof(*w));
+	assert(w);
+	for (t = 0; t < nthreads; t++) {
+		w[t].p = &p;
+		w[t].x = x;
+		w[t].mean = mean;
+		w[t].step = window - overlap;
+		w[t].first = t;
+		w[t].stride = nthreads;
+		w[t].segments = segments;
+		w[t].acc = calloc(nbins, sizeof(double));
+		assert(w[t].acc);
+		/* thread 0 is us */
+		if (t && pthread_create(&w[t].thread, NULL, worker, &w[t])) {
+			fprintf(stderr, "welch: pthread_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	worker(&w[0]);
+	for (t = 1; t < nthreads; t++) {
+		pthread_join(w[t].thread, NULL);
+		for (k = 0; k < nbins; k++)
+			w[0].acc[k] += w[t].acc[k];
+		free(w[t].acc);
+	}
+
+	/* one-sided density: double everything but DC and Nyquist */
+	out->psd = w[0].acc;
+	for (k = 0; k < nbins; k++) {
+		out->psd[k] /= segments * opts->fs * p.winpow;
+		if (k && k != nbins - 1)
+			out->psd[k] *= 2;
+	}
+	out->nbins = nbins;
+	out->nfft = nfft;
+	out->window = window;
+	out->overlap = overlap;
+	out->segments = segments;
+	out->fs = opts->fs;
+
+	free(w);
+	plan_free(&p);
+	return 0;
+}
+
+/* straight from the sample buffers ftq measures into. */
+int welch_samples(const struct sample *samples, size_t n,
+                  const struct welch_opts *opts, struct welch_psd *out)
+{
+	double *x = malloc(n * sizeof(double));
+	size_t i;
+	int ret;
+
+	if (!x) {
+		fprintf(stderr, "welch: out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		x[i] = samples[i].count;
+	ret = welch(x, n, opts, out);
+	free(x);
+	return ret;
+}
+
+void welch_free(struct welch_psd *out)
+{
+	free(out->psd);
+	memset(out, 0, sizeof(*out));
+}
+
+int welch_write_csv(FILE *f, const struct welch_psd *p)
+{
+	size_t k;
+
+	fprintf(f, "# fs %f nfft %zu window %zu overlap %zu segments %zu\n",
+	        p->fs, p->nfft, p->window, p->overlap, p->segments);
+	fprintf(f, "freq,psd\n");
+	for (k = 0; k < p->nbins; k++)
+		fprintf(f, "%.9g,%.9g\n", k * p->fs / p->nfft, p->psd[k]);
+	return ferror(f) ? -1 : 0;
+}
+
+int welch_write_bin(FILE *f, const struct welch_psd *p, int wintype)
+{
+	struct welch_bin_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, WELCH_MAGIC, sizeof(h.magic));
+	h.version = WELCH_VERSION;
+	h.wintype = wintype;
+	h.nbins = p->nbins;
+	h.nfft = p->nfft;
+	h.window = p->window;
+	h.overlap = p->overlap;
+	h.segments = p->segments;
+	h.fs = p->fs;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		return -1;
+	if (fwrite(p->psd, sizeof(double), p->nbins, f) != p->nbins)
+		return -1;
+	return 0;
+}
+
+int welch_wintype(const char *name)
+{
+	if (!strcmp(name, "hamming"))
+		return WELCH_HAMMING;
+	if (!strcmp(name, "hann") || !strcmp(name, "hanning"))
+		return WELCH_HANN;
+	if (!strcmp(name, "rect") || !strcmp(name, "none"))
+		return WELCH_RECT;
+	return -1;
+}
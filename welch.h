@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#pragma once
+
+/*
+ * Welch power spectral density, in-process, so that we do not need R or
+ * octave on every box we analyze on.
+ *
+ * With all options left at 0 the answer matches
+ *	pwelch(x(:,2),[],[],[],fs)
+ * i.e. the mean of the whole run taken out first (pwelch's 'long-mean'),
+ * a Hamming window sized to give 8 segments at 50% overlap, an FFT
+ * length of the next power of 2 (at least 256), and a one-sided density
+ * in units of count^2/Hz.
+ */
+#include <stdio.h>
+#include <stddef.h>
+
+#include "ftq.h"
+
+enum {
+	WELCH_HAMMING = 0,
+	WELCH_HANN,
+	WELCH_RECT,
+};
+
+/* pwelch's default is the mean, so that is 0 */
+enum {
+	WELCH_DETREND_MEAN = 0,
+	WELCH_DETREND_NONE,
+};
+
+#define WELCH_NO_OVERLAP ((size_t)-1)
+
+struct welch_opts {
+	size_t window;		/* segment length; 0 for 8 segments */
+	size_t overlap;		/* in samples; 0 for 50%, or WELCH_NO_OVERLAP */
+	size_t nfft;		/* 0 for the next power of 2 >= window; >= 8 */
+	int wintype;
+	int detrend;
+	double fs;		/* sample frequency, Hz */
+	int nthreads;		/* segments are spread over these */
+};
+
+/* the result: nbins = nfft/2 + 1 bins, bin k is at k * fs / nfft Hz. */
+struct welch_psd {
+	double *psd;
+	size_t nbins;
+	size_t nfft;
+	size_t window;
+	size_t overlap;
+	size_t segments;
+	double fs;
+};
+
+/* binary PSD files: this header, then nbins doubles. */
+#define WELCH_MAGIC "FTQPSD\n"
+#define WELCH_VERSION 1
+struct welch_bin_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int wintype;
+	unsigned long long nbins;
+	unsigned long long nfft;
+	unsigned long long window;
+	unsigned long long overlap;
+	unsigned long long segments;
+	double fs;
+};
+
+/* welch.c */
+int welch(const double *x, size_t n, const struct welch_opts *opts,
+          struct welch_psd *out);
+int welch_samples(const struct sample *samples, size_t n,
+                  const struct welch_opts *opts, struct welch_psd *out);
+void welch_free(struct welch_psd *out);
+int welch_write_csv(FILE *f, const struct welch_psd *p);
+int welch_write_bin(FILE *f, const struct welch_psd *p, int wintype);
+int welch_wintype(const char *name);